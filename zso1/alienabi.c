@@ -0,0 +1,126 @@
+#include <sys/uio.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "alienabi.h"
+#include "alienos.h"
+#include "random.h"
+#include "screen.h"
+
+/* Bounds are checked as n > MAX_X - x, which cannot overflow for any n
+ * and x in range, unlike x + n > MAX_X. */
+
+const char *abiend(uint64_t rdi, int *status)
+{
+    *status = (int) rdi;
+    if (*status < 0 || *status > 63)
+        return "end: invalid status";
+
+    return NULL;
+}
+
+const char *abigetrand(struct randpool *pool,
+                       long (*getrandom)(void *buf, size_t len),
+                       uint32_t *rand)
+{
+    uint8_t key[RAND_KEYLEN];
+    long r;
+
+    if (randstale(pool)) {
+        r = getrandom(key, sizeof key);
+        if (r == -1)
+            return "getrandom";
+        if (r != sizeof key)
+            return "getrandom: short read";
+
+        randkey(pool, key);
+    }
+
+    *rand = randnext(pool);
+    return NULL;
+}
+
+const char *abiprintargs(uint64_t rdi, uint64_t rsi, uint64_t rdx,
+                         uint64_t r10, struct abiprint *p,
+                         struct iovec *local, struct iovec *remote)
+{
+    p->x = (int) rdi;
+    p->y = (int) rsi;
+    p->n = (int) r10;
+
+    if (p->y < 0 || p->y >= MAX_Y || p->x < 0 || p->n <= 0
+            || p->n > MAX_X - p->x)
+        return "print: invalid x or y or n";
+
+    local->iov_base = p->chars;
+    local->iov_len = p->n * sizeof (uint16_t);
+    remote->iov_base = (void *) rdx;
+    remote->iov_len = local->iov_len;
+
+    return NULL;
+}
+
+void abiprint(struct screen *s, const struct abiprint *p)
+{
+    scrprint(s, p->x, p->y, p->chars, p->n);
+}
+
+const char *abispansargs(uint64_t rdi, uint64_t rsi, struct abispans *p,
+                         struct iovec *local, struct iovec *remote)
+{
+    p->n = (int) rsi;
+    if (p->n <= 0 || p->n > ALIEN_MAX_SPANS)
+        return "printspans: invalid n";
+
+    local->iov_base = p->spans;
+    local->iov_len = p->n * sizeof *p->spans;
+    remote->iov_base = (void *) rdi;
+    remote->iov_len = local->iov_len;
+
+    return NULL;
+}
+
+const char *abispanschars(struct abispans *p, struct iovec *local,
+                          struct iovec *remote)
+{
+    const struct alienspan *sp;
+    int i;
+
+    for (i = 0; i < p->n; ++i)
+    {
+        sp = &p->spans[i];
+        if (sp->y < 0 || sp->y >= MAX_Y || sp->x < 0 || sp->n <= 0
+                || sp->n > MAX_X - sp->x)
+            return "printspans: invalid x or y or n";
+
+        local[i].iov_base = p->chars[i];
+        local[i].iov_len = sp->n * sizeof (uint16_t);
+        remote[i].iov_base = (void *) sp->chars;
+        remote[i].iov_len = local[i].iov_len;
+    }
+
+    return NULL;
+}
+
+void abispans(struct screen *s, const struct abispans *p)
+{
+    const struct alienspan *sp;
+    int i;
+
+    for (i = 0; i < p->n; ++i)
+    {
+        sp = &p->spans[i];
+        scrprint(s, sp->x, sp->y, p->chars[i], sp->n);
+    }
+}
+
+const char *abicursor(uint64_t rdi, uint64_t rsi, int *x, int *y)
+{
+    *x = (int) rdi;
+    *y = (int) rsi;
+    if (*x < 0 || *x >= MAX_X || *y < 0 || *y >= MAX_Y)
+        return "setcursor: invalid x or y";
+
+    return NULL;
+}
@@ -0,0 +1,66 @@
+#ifndef ALIENABI_H
+#define ALIENABI_H
+
+#include <sys/uio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "alienos.h"
+#include "random.h"
+#include "screen.h"
+
+/* What the AlienOS syscalls mean, for every backend: emu.c (ptrace),
+ * trap.c (seccomp and rewrite) and supervise.c (-m). They differ only in
+ * how they reach the program's memory and how they fail it, so the
+ * checks return NULL if the arguments are valid and otherwise what is
+ * wrong with them, and memory is read by the caller, as set up in iovecs
+ * (local in our buffers, remote in the program). Arguments are passed
+ * the way they come, rdi, rsi, rdx and r10. */
+
+/* void noreturn end(int status) */
+const char *abiend(uint64_t rdi, int *status);
+
+/* uint32_t getrand(). getrandom fills buf with len bytes from the host
+ * and returns how many it did, -1 on error. */
+const char *abigetrand(struct randpool *pool,
+                       long (*getrandom)(void *buf, size_t len),
+                       uint32_t *rand);
+
+/* void print(int x, int y, uint16_t *chars, int n) */
+struct abiprint {
+    int x, y, n;
+    uint16_t chars[MAX_X];
+};
+
+/* Check print and set up reading its chars into p->chars. */
+const char *abiprintargs(uint64_t rdi, uint64_t rsi, uint64_t rdx,
+                         uint64_t r10, struct abiprint *p,
+                         struct iovec *local, struct iovec *remote);
+
+/* Draw what abiprintargs checked, once the chars are read. */
+void abiprint(struct screen *s, const struct abiprint *p);
+
+/* void printspans(const struct alienspan *spans, int n) */
+struct abispans {
+    int n;
+    struct alienspan spans[ALIEN_MAX_SPANS];
+    uint16_t chars[ALIEN_MAX_SPANS][MAX_X];
+};
+
+/* Check n and set up reading the spans into p->spans. */
+const char *abispansargs(uint64_t rdi, uint64_t rsi, struct abispans *p,
+                         struct iovec *local, struct iovec *remote);
+
+/* Check every span read and set up reading the chars of span i into
+ * p->chars[i] with local[i] and remote[i], p->n of them. Nothing is drawn
+ * unless every span is valid. */
+const char *abispanschars(struct abispans *p, struct iovec *local,
+                          struct iovec *remote);
+
+/* Draw what abispanschars checked, once the chars are read. */
+void abispans(struct screen *s, const struct abispans *p);
+
+/* void setcursor(int x, int y) */
+const char *abicursor(uint64_t rdi, uint64_t rsi, int *x, int *y);
+
+#endif // ALIENABI_H
@@ -1,3 +1,8 @@
+#ifndef ALIENOS_H
+#define ALIENOS_H
+
+#include <stdint.h>
+
 #define ALIEN_KEY_ENTER 0x0a
 #define ALIEN_KEY_UP 0x80
 #define ALIEN_KEY_LEFT 0x81
@@ -7,3 +12,22 @@
 #define ALIEN_ASCII_MAX 0x7e
 
 #define PT_PARAMS 0x60031337
+
+/* Extension: the emulator maps its 80x24 uint16_t screen, cells as in
+ * print, at the p_vaddr (page aligned) of a segment of this type. The
+ * program draws by writing to it; syscall 6, void present(), tells the
+ * emulator a frame is complete, or it looks by itself every so often. */
+#define PT_FRAMEBUF 0x60031338
+
+/* Extension, syscall 5: void printspans(const struct alienspan *spans,
+ * int n) does print(x, y, chars, n) for every span, all in one go. */
+struct alienspan {
+    int32_t x, y;
+    uint64_t chars;
+    int32_t n;
+    int32_t reserved;
+};
+
+#define ALIEN_MAX_SPANS 1024
+
+#endif // ALIENOS_H
@@ -0,0 +1,355 @@
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <termios.h>
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alienos.h"
+#include "ansi.h"
+#include "display.h"
+#include "emuerr.h"
+#include "screen.h"
+
+#define ESC "\033"
+
+#define ANSI_INIT 4096
+
+#define CLEAR ESC "[0m" ESC "[H" ESC "[2J"
+#define ALTSCREEN_ON ESC "[?1049h"
+#define ALTSCREEN_OFF ESC "[0m" ESC "[?1049l"
+
+/* Room for the longest cursor move moveto considers. */
+#define MOVE_MAX 32
+
+
+static void output(struct ansi *a, const char *s, size_t n)
+{
+    while (a->len + n > a->cap)
+    {
+        a->cap = a->cap ? 2 * a->cap : ANSI_INIT;
+        a->buf = realloc(a->buf, a->cap);
+        if (!a->buf) EMUERR("ansi: realloc");
+    }
+
+    memcpy(a->buf + a->len, s, n);
+    a->len += n;
+}
+
+static void outprintf(struct ansi *a, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void outprintf(struct ansi *a, const char *format, ...)
+{
+    char buf[32];
+    va_list ap;
+    int n;
+
+    va_start(ap, format);
+    n = vsnprintf(buf, sizeof buf, format, ap);
+    va_end(ap);
+
+    output(a, buf, n);
+}
+
+/* What the terminal shows for a cell, the same as ncurses. */
+static char cellchar(uint16_t cell)
+{
+    int ch;
+
+    ch = CELL_CH(cell);
+    if (ch < ALIEN_ASCII_MIN || ch > ALIEN_ASCII_MAX)
+        return '?';
+
+    return ch;
+}
+
+/* "\033[nX", n left out when 1. */
+static int csi(char *buf, int n, char op)
+{
+    if (n == 1)
+        return sprintf(buf, ESC "[%c", op);
+    return sprintf(buf, ESC "[%d%c", n, op);
+}
+
+/* Move within row y from column from to x, into buf. */
+static int horizontal(const struct ansi *a, char *buf, int y, int from, int x)
+{
+    const uint16_t *row = a->shown[y];
+    char alt[MOVE_MAX];
+    int n, m;
+    int i;
+
+    if (x == from)
+        return 0;
+
+    if (x == 0) {
+        buf[0] = '\r';
+        return 1;
+    }
+
+    if (x > from) {
+        n = csi(buf, x - from, 'C');
+
+        /* Reprinting what is there already may be shorter still. */
+        if (x - from > n || a->y != y)
+            return n;
+        for (i = from; i < x; ++i)
+            if (row[i] == CELL_NONE || CELL_COLOR(row[i]) != a->color)
+                return n;
+        for (i = from; i < x; ++i)
+            buf[i - from] = cellchar(row[i]);
+        return x - from;
+    }
+
+    n = from - x;
+    if (n < 3)
+        memset(buf, '\b', n);
+    else
+        n = csi(buf, n, 'D');
+
+    alt[0] = '\r';
+    m = 1 + csi(alt + 1, x, 'C');
+    if (m < n) {
+        memcpy(buf, alt, m);
+        n = m;
+    }
+
+    return n;
+}
+
+static void moveto(struct ansi *a, int x, int y)
+{
+    char best[MOVE_MAX], rel[MOVE_MAX];
+    int n, m;
+    int from;
+
+    if (a->x == x && a->y == y)
+        return;
+
+    if (x == 0 && y == 0)
+        n = sprintf(best, ESC "[H");
+    else
+        n = sprintf(best, ESC "[%d;%dH", y + 1, x + 1);
+
+    /* After the last column only the row is known, \r fixes that. */
+    m = 0;
+    from = a->x;
+    if (from == -1) {
+        rel[m++] = '\r';
+        from = 0;
+    }
+    if (y > a->y)
+        m += csi(rel + m, y - a->y, 'B');
+    else if (y < a->y)
+        m += csi(rel + m, a->y - y, 'A');
+    m += horizontal(a, rel + m, y, from, x);
+
+    if (m < n) {
+        memcpy(best, rel, m);
+        n = m;
+    }
+
+    output(a, best, n);
+    a->x = x;
+    a->y = y;
+}
+
+/* Only send the half of the colors that changes. */
+static void setcolor(struct ansi *a, int color)
+{
+    const struct colorpair *from, *to;
+
+    if (color == a->color)
+        return;
+
+    to = &aliencolors[color];
+    if (a->color == -1) {
+        outprintf(a, ESC "[%d;%dm", 30 + to->fg, 40 + to->bg);
+    }
+    else {
+        from = &aliencolors[a->color];
+        if (from->fg == to->fg)
+            outprintf(a, ESC "[%dm", 40 + to->bg);
+        else if (from->bg == to->bg)
+            outprintf(a, ESC "[%dm", 30 + to->fg);
+        else
+            outprintf(a, ESC "[%d;%dm", 30 + to->fg, 40 + to->bg);
+    }
+
+    a->color = color;
+}
+
+void ansiclear(struct ansi *a)
+{
+    int x, y;
+
+    output(a, CLEAR, sizeof CLEAR - 1);
+
+    a->x = 0;
+    a->y = 0;
+    a->color = -1;
+    for (y = 0; y < MAX_Y; ++y)
+        for (x = 0; x < MAX_X; ++x)
+            a->shown[y][x] = CELL_NONE;
+}
+
+void ansiputcells(struct ansi *a, int x, int y, const uint16_t *cells, int n)
+{
+    char c;
+    int i;
+
+    moveto(a, x, y);
+    for (i = 0; i < n; ++i)
+    {
+        setcolor(a, CELL_COLOR(cells[i]));
+
+        c = cellchar(cells[i]);
+        output(a, &c, 1);
+        a->shown[y][x + i] = cells[i];
+    }
+
+    a->x = x + n < MAX_X ? x + n : -1;
+}
+
+void ansicursor(struct ansi *a, int x, int y)
+{
+    moveto(a, x, y);
+}
+
+int ansikey(FILE *in)
+{
+    int ch;
+
+    for (;;)
+    {
+        ch = getc(in);
+        if (ch == EOF)
+            EMUERR("getkey: no more input");
+
+        if (ch == '\n' || ch == '\r')
+            return ALIEN_KEY_ENTER;
+
+        if (ch >= ALIEN_ASCII_MIN && ch <= ALIEN_ASCII_MAX)
+            return ch;
+
+        /* Arrows: ESC [ x, or ESC O x in application cursor mode. */
+        if (ch != '\033')
+            continue;
+        ch = getc(in);
+        if (ch != '[' && ch != 'O') {
+            /* A lone ESC, the next key is a key of its own. */
+            if (ch != EOF)
+                ungetc(ch, in);
+            continue;
+        }
+
+        switch (getc(in)) {
+        case 'A':
+            return ALIEN_KEY_UP;
+        case 'B':
+            return ALIEN_KEY_DOWN;
+        case 'C':
+            return ALIEN_KEY_RIGHT;
+        case 'D':
+            return ALIEN_KEY_LEFT;
+        }
+    }
+}
+
+
+/* The display: an 80x24 terminal on stdin and stdout, written to directly
+ * with the sequences built above, one write per frame. */
+
+static struct ansi term;
+static struct termios saved;
+static int termset;
+
+static void writeall(const char *buf, size_t len)
+{
+    ssize_t r;
+
+    while (len > 0)
+    {
+        r = write(STDOUT_FILENO, buf, len);
+        if (r == -1 && errno == EINTR)
+            continue;
+        SYSERR(r, "write");
+
+        buf += r;
+        len -= r;
+    }
+}
+
+static void exitansi()
+{
+    if (!termset)
+        return;
+
+    writeall(ALTSCREEN_OFF, sizeof ALTSCREEN_OFF - 1);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+    termset = 0;
+}
+
+static void initansi(const char *record)
+{
+    struct winsize ws;
+    struct termios t;
+    int r;
+
+    if (record)
+        EMUERR("Only the headless display can record");
+
+    r = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
+    SYSERR(r, "TIOCGWINSZ");
+    if (ws.ws_col != MAX_X || ws.ws_row != MAX_Y)
+        EMUERR("The terminal size is not 80x24");
+
+    /* Keys one at a time and not echoed, like cbreak and noecho. */
+    r = tcgetattr(STDIN_FILENO, &saved);
+    SYSERR(r, "tcgetattr");
+    t = saved;
+    t.c_lflag &= ~(ICANON | ECHO);
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+    r = tcsetattr(STDIN_FILENO, TCSANOW, &t);
+    SYSERR(r, "tcsetattr");
+
+    termset = 1;
+    atexit(exitansi);
+
+    /* The alternate screen, so the shell gets its own back at the end. */
+    writeall(ALTSCREEN_ON, sizeof ALTSCREEN_ON - 1);
+    ansiclear(&term);
+}
+
+static void clearansi() { ansiclear(&term); }
+
+static void putcells(int x, int y, const uint16_t *cells, int n)
+{
+    ansiputcells(&term, x, y, cells, n);
+}
+
+static void flush(int curx, int cury)
+{
+    ansicursor(&term, curx, cury);
+
+    writeall(term.buf, term.len);
+    term.len = 0;
+}
+
+static int getkey() { return ansikey(stdin); }
+
+const struct display ansidisplay = {
+    .name = "ansi",
+    .init = initansi,
+    .fini = exitansi,
+    .clear = clearansi,
+    .putcells = putcells,
+    .flush = flush,
+    .getkey = getkey,
+};
@@ -0,0 +1,36 @@
+#ifndef ANSI_H
+#define ANSI_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#include "screen.h"
+
+/* Builds the escape sequences that bring a terminal showing the alien
+ * screen up to date. It remembers what the terminal shows, where its
+ * cursor is and which colors are set, to send as few bytes as it can. */
+struct ansi {
+    /* Output not taken by the caller yet. */
+    char *buf;
+    size_t len, cap;
+
+    /* Terminal cursor. x is -1 after the last column was written to,
+     * where terminals disagree on where it is. */
+    int x, y;
+    /* Alien color of the current attributes, -1 when unknown. */
+    int color;
+    uint16_t shown[MAX_Y][MAX_X];
+};
+
+/* Clear the terminal and forget everything about it. */
+void ansiclear(struct ansi *a);
+
+void ansiputcells(struct ansi *a, int x, int y, const uint16_t *cells, int n);
+
+void ansicursor(struct ansi *a, int x, int y);
+
+/* Read a key the alien program understands from a terminal. */
+int ansikey(FILE *in);
+
+#endif // ANSI_H
@@ -0,0 +1,401 @@
+/* Writes synthetic AlienOS programs for benchmarking the emulator.
+ * Usage: bench/alienelf [-m bss_mib] <workload> <output>
+ *
+ * Every program takes one parameter, the number of iterations, and then
+ * calls end(0). The workloads, with syscalls per iteration:
+ *     print      1   print a full row, cycling through the rows
+ *     getrand    1   getrand
+ *     setcursor  1   setcursor to the start of a row, cycling
+ *     game      26   a frame: getrand, print all 24 rows with colors picked
+ *                    by the random number, setcursor
+ *     bss        0   write one byte to each of the first n pages of a
+ *                    bss_mib (default 256) MiB bss, n clamped to its size
+ *
+ * and, for bench/check.sh, programs the emulator must end with status 0:
+ *     r8dsite        setcursor(0, 0) through `mov $0x50, %r8d; syscall`,
+ *                    which ends in the bytes of `mov $0x50, %eax; syscall`
+ *
+ * or with status 127 (EEMU), whatever their parameter:
+ *     badprint       print(1, 0, bss, INT32_MAX), plenty of readable
+ *                    memory behind bss for an unchecked read to run over
+ *     badspan        printspans of one span { 1, 0, bss, INT32_MAX }
+ *     badchars       print(0, 0, 16, 80), the chars at an unmapped address
+ *
+ * The file holds the headers, rodata and code in one R+X PT_LOAD segment
+ * and the parameter (doubling as PT_PARAMS) and bss in an R+W one. The
+ * code is emitted as raw x86-64 below, syscalls always as the
+ * `mov $nr, %eax; syscall` pair the rewrite backend looks for. */
+
+#include <elf.h>
+#include <unistd.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../alienos.h"
+
+#define PAGE_SIZE 4096
+
+#define TEXT_VADDR 0x31337000
+#define DATA_VADDR 0x31400000
+/* The bss starts on the page after the parameter. */
+#define BSS_VADDR (DATA_VADDR + PAGE_SIZE)
+
+#define NPHDRS 3
+#define HEADERS_SIZE (sizeof (Elf64_Ehdr) + NPHDRS * sizeof (Elf64_Phdr))
+
+/* Rows in every color, at the start of rodata. */
+#define NCOLORS 8
+#define ROW_SIZE (80 * sizeof (uint16_t))
+#define ROWS_VADDR (TEXT_VADDR + HEADERS_SIZE)
+#define CODE_VADDR (ROWS_VADDR + NCOLORS * ROW_SIZE)
+
+#define CODE_MAX 4096
+
+#define SYS_END 0
+#define SYS_GETRAND 1
+#define SYS_PRINT 3
+#define SYS_SETCURSOR 4
+#define SYS_PRINTSPANS 5
+
+/* Where badspan builds its span, in the page of the parameter. */
+#define SPAN_VADDR (DATA_VADDR + 64)
+
+static uint8_t code[CODE_MAX];
+static size_t len;
+
+#define EMIT(...) emit((const uint8_t []) { __VA_ARGS__ }, \
+                       sizeof ((const uint8_t []) { __VA_ARGS__ }))
+
+
+static void emit(const uint8_t *bytes, size_t n)
+{
+    if (len + n > CODE_MAX) {
+        fprintf(stderr, "alienelf: code too long\n");
+        exit(1);
+    }
+
+    memcpy(code + len, bytes, n);
+    len += n;
+}
+
+static void emit32(uint32_t v)
+{
+    EMIT(v, v >> 8, v >> 16, v >> 24);
+}
+
+static uint64_t here() { return CODE_VADDR + len; }
+
+/* rel32 operand ending at the current position, pointing to target. */
+static void emitrel(uint64_t target)
+{
+    emit32(target - (here() + 4));
+}
+
+static void syscallnr(int nr)
+{
+    EMIT(0xb8); emit32(nr);                     /* mov $nr, %eax */
+    EMIT(0x0f, 0x05);                           /* syscall */
+}
+
+/* Loop head: jump to the returned patch site once %ebx reaches 0. */
+static size_t loophead()
+{
+    EMIT(0x85, 0xdb);                           /* test %ebx, %ebx */
+    EMIT(0x0f, 0x84); emit32(0);                /* jz done */
+    return len - 4;
+}
+
+/* Loop tail: count %ebx down and go back to head. */
+static void looptail(uint64_t head, size_t done)
+{
+    uint32_t rel;
+
+    EMIT(0xff, 0xcb);                           /* dec %ebx */
+    EMIT(0xe9); emitrel(head);                  /* jmp head */
+
+    rel = len - (done + 4);
+    memcpy(code + done, &rel, sizeof rel);
+}
+
+/* %r12d = (%r12d + 1) % 24 */
+static void nextrow()
+{
+    EMIT(0x41, 0xff, 0xc4);                     /* inc %r12d */
+    EMIT(0x41, 0x83, 0xfc, 24);                 /* cmp $24, %r12d */
+    EMIT(0x75, 3);                              /* jne 1f */
+    EMIT(0x45, 0x31, 0xe4);                     /* xor %r12d, %r12d */
+}                                               /* 1: */
+
+/* print(0, %r12d, row of color %eax, 80) */
+static void printrow()
+{
+    EMIT(0x83, 0xe0, NCOLORS - 1);              /* and $7, %eax */
+    EMIT(0x69, 0xc0); emit32(ROW_SIZE);         /* imul $160, %eax, %eax */
+    EMIT(0x48, 0x8d, 0x15); emitrel(ROWS_VADDR);/* lea rows(%rip), %rdx */
+    EMIT(0x48, 0x01, 0xc2);                     /* add %rax, %rdx */
+    EMIT(0x31, 0xff);                           /* xor %edi, %edi */
+    EMIT(0x44, 0x89, 0xe6);                     /* mov %r12d, %esi */
+    EMIT(0x41, 0xba); emit32(80);               /* mov $80, %r10d */
+    syscallnr(SYS_PRINT);
+}
+
+static void genprint()
+{
+    uint64_t head = here();
+    size_t done = loophead();
+
+    EMIT(0x44, 0x89, 0xe0);                     /* mov %r12d, %eax */
+    printrow();
+    nextrow();
+
+    looptail(head, done);
+}
+
+static void gengetrand()
+{
+    uint64_t head = here();
+    size_t done = loophead();
+
+    syscallnr(SYS_GETRAND);
+
+    looptail(head, done);
+}
+
+static void gensetcursor()
+{
+    uint64_t head = here();
+    size_t done = loophead();
+
+    EMIT(0x31, 0xff);                           /* xor %edi, %edi */
+    EMIT(0x44, 0x89, 0xe6);                     /* mov %r12d, %esi */
+    syscallnr(SYS_SETCURSOR);
+    nextrow();
+
+    looptail(head, done);
+}
+
+static void gengame()
+{
+    uint64_t head = here(), row;
+    size_t done = loophead();
+
+    syscallnr(SYS_GETRAND);
+    EMIT(0x41, 0x89, 0xc5);                     /* mov %eax, %r13d */
+    EMIT(0x45, 0x31, 0xe4);                     /* xor %r12d, %r12d */
+
+    row = here();
+    EMIT(0x44, 0x89, 0xe8);                     /* mov %r13d, %eax */
+    EMIT(0x44, 0x01, 0xe0);                     /* add %r12d, %eax */
+    printrow();
+    EMIT(0x41, 0xff, 0xc4);                     /* inc %r12d */
+    EMIT(0x41, 0x83, 0xfc, 24);                 /* cmp $24, %r12d */
+    EMIT(0x0f, 0x85); emitrel(row);             /* jne row */
+
+    EMIT(0x31, 0xff);                           /* xor %edi, %edi */
+    EMIT(0xbe); emit32(23);                     /* mov $23, %esi */
+    syscallnr(SYS_SETCURSOR);
+
+    looptail(head, done);
+}
+
+static void genbss(uint32_t pages)
+{
+    uint64_t head;
+    size_t done;
+
+    EMIT(0xb9); emit32(pages);                  /* mov $pages, %ecx */
+    EMIT(0x39, 0xcb);                           /* cmp %ecx, %ebx */
+    EMIT(0x0f, 0x47, 0xd9);                     /* cmova %ecx, %ebx */
+    EMIT(0xb8); emit32(BSS_VADDR);              /* mov $bss, %eax */
+
+    head = here();
+    done = loophead();
+    EMIT(0xc6, 0x00, 0x01);                     /* movb $1, (%rax) */
+    EMIT(0x48, 0x05); emit32(PAGE_SIZE);        /* add $4096, %rax */
+    looptail(head, done);
+}
+
+static void genbadprint()
+{
+    EMIT(0xbf); emit32(1);                      /* mov $1, %edi */
+    EMIT(0x31, 0xf6);                           /* xor %esi, %esi */
+    EMIT(0xba); emit32(BSS_VADDR);              /* mov $bss, %edx */
+    EMIT(0x41, 0xba); emit32(INT32_MAX);        /* mov $INT32_MAX, %r10d */
+    syscallnr(SYS_PRINT);
+}
+
+static void genbadchars()
+{
+    EMIT(0x31, 0xff);                           /* xor %edi, %edi */
+    EMIT(0x31, 0xf6);                           /* xor %esi, %esi */
+    EMIT(0xba); emit32(16);                     /* mov $16, %edx */
+    EMIT(0x41, 0xba); emit32(80);               /* mov $80, %r10d */
+    syscallnr(SYS_PRINT);
+}
+
+static void genr8dsite()
+{
+    EMIT(0xb8); emit32(SYS_SETCURSOR);          /* mov $4, %eax */
+    EMIT(0x31, 0xff);                           /* xor %edi, %edi */
+    EMIT(0x31, 0xf6);                           /* xor %esi, %esi */
+    EMIT(0x41, 0xb8); emit32(0x50);             /* mov $0x50, %r8d */
+    EMIT(0x0f, 0x05);                           /* syscall */
+}
+
+/* movl $v, addr */
+static void store32(uint32_t addr, uint32_t v)
+{
+    EMIT(0xc7, 0x04, 0x25); emit32(addr); emit32(v);
+}
+
+static void genbadspan()
+{
+    store32(SPAN_VADDR + offsetof (struct alienspan, x), 1);
+    store32(SPAN_VADDR + offsetof (struct alienspan, y), 0);
+    /* The upper half of chars is still 0, like the page. */
+    store32(SPAN_VADDR + offsetof (struct alienspan, chars), BSS_VADDR);
+    store32(SPAN_VADDR + offsetof (struct alienspan, n), INT32_MAX);
+    EMIT(0xbf); emit32(SPAN_VADDR);             /* mov $span, %edi */
+    EMIT(0xbe); emit32(1);                      /* mov $1, %esi */
+    syscallnr(SYS_PRINTSPANS);
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: alienelf [-m bss_mib] "
+            "print|getrand|setcursor|game|bss|r8dsite|badprint|"
+            "badspan|badchars <output>\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct {
+        Elf64_Ehdr ehdr;
+        Elf64_Phdr phdrs[NPHDRS];
+        uint16_t rows[NCOLORS][80];
+    } head;
+    Elf64_Phdr *text, *data, *params;
+    uint64_t bss = 256;
+    uint64_t textsz, dataoff;
+    uint32_t iters = 0;
+    const char *workload;
+    FILE *f;
+    int opt;
+    int c, x;
+
+    while ((opt = getopt(argc, argv, "m:")) != -1)
+    {
+        switch (opt) {
+        case 'm':
+            bss = strtoull(optarg, NULL, 0);
+            if (bss == 0 || bss > 16384)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 2)
+        usage();
+    workload = argv[optind];
+    bss <<= 20;
+
+    /* Every program starts by loading its iteration count. */
+    EMIT(0x8b, 0x1d); emitrel(DATA_VADDR);      /* mov iters(%rip), %ebx */
+    EMIT(0x45, 0x31, 0xe4);                     /* xor %r12d, %r12d */
+
+    if (!strcmp(workload, "print"))
+        genprint();
+    else if (!strcmp(workload, "getrand"))
+        gengetrand();
+    else if (!strcmp(workload, "setcursor"))
+        gensetcursor();
+    else if (!strcmp(workload, "game"))
+        gengame();
+    else if (!strcmp(workload, "bss"))
+        genbss(bss / PAGE_SIZE);
+    else if (!strcmp(workload, "r8dsite"))
+        genr8dsite();
+    else if (!strcmp(workload, "badprint"))
+        genbadprint();
+    else if (!strcmp(workload, "badspan"))
+        genbadspan();
+    else if (!strcmp(workload, "badchars"))
+        genbadchars();
+    else
+        usage();
+
+    EMIT(0x31, 0xff);                           /* xor %edi, %edi */
+    syscallnr(SYS_END);
+
+    textsz = sizeof head + len;
+    dataoff = (textsz + PAGE_SIZE - 1) & ~(uint64_t) (PAGE_SIZE - 1);
+
+    memset(&head, 0, sizeof head);
+    memcpy(head.ehdr.e_ident, ELFMAG, SELFMAG);
+    head.ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    head.ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    head.ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    head.ehdr.e_type = ET_EXEC;
+    head.ehdr.e_machine = EM_X86_64;
+    head.ehdr.e_version = EV_CURRENT;
+    head.ehdr.e_entry = CODE_VADDR;
+    head.ehdr.e_phoff = sizeof head.ehdr;
+    head.ehdr.e_ehsize = sizeof head.ehdr;
+    head.ehdr.e_phentsize = sizeof *head.phdrs;
+    head.ehdr.e_phnum = NPHDRS;
+
+    text = &head.phdrs[0];
+    text->p_type = PT_LOAD;
+    text->p_flags = PF_R | PF_X;
+    text->p_offset = 0;
+    text->p_vaddr = TEXT_VADDR;
+    text->p_filesz = textsz;
+    text->p_memsz = textsz;
+    text->p_align = PAGE_SIZE;
+
+    data = &head.phdrs[1];
+    data->p_type = PT_LOAD;
+    data->p_flags = PF_R | PF_W;
+    data->p_offset = dataoff;
+    data->p_vaddr = DATA_VADDR;
+    data->p_filesz = sizeof iters;
+    data->p_memsz = strcmp(workload, "bss") && strncmp(workload, "bad", 3)
+                    ? sizeof iters : PAGE_SIZE + bss;
+    data->p_align = PAGE_SIZE;
+
+    params = &head.phdrs[2];
+    params->p_type = PT_PARAMS;
+    params->p_flags = PF_R | PF_W;
+    params->p_offset = dataoff;
+    params->p_vaddr = DATA_VADDR;
+    params->p_filesz = sizeof iters;
+    params->p_memsz = sizeof iters;
+    params->p_align = 4;
+
+    /* A printable character in every color, different per row. */
+    for (c = 0; c < NCOLORS; ++c)
+        for (x = 0; x < 80; ++x)
+            head.rows[c][x] = c << 8 | ('A' + (c + x) % 26);
+
+    f = fopen(argv[optind + 1], "w");
+    if (!f) {
+        perror(argv[optind + 1]);
+        exit(1);
+    }
+    fwrite(&head, sizeof head, 1, f);
+    fwrite(code, len, 1, f);
+    fseek(f, dataoff, SEEK_SET);
+    fwrite(&iters, sizeof iters, 1, f);
+    if (fclose(f) == EOF) {
+        perror(argv[optind + 1]);
+        exit(1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Run odd alien programs (see bench/alienelf.c) with every backend: the
+# bad* ones are invalid and have to end with status 127 (EEMU), not a
+# crash, the others with 0.
+# Usage: bench/check.sh prog... (from the zso1 directory, after `make check`)
+
+FAILED=0
+
+for PROG in "$@"
+do
+    case $(basename $PROG) in
+        bad*) WANT=127 ;;
+        *) WANT=0 ;;
+    esac
+
+    for ARGS in "-b ptrace" "-b seccomp" "-b rewrite" "-b ptrace -L"
+    do
+        ./emu $ARGS -d headless $PROG 0 < /dev/null > /dev/null 2>&1
+        STATUS=$?
+        if [ $STATUS -ne $WANT ]; then
+            echo "$PROG ($ARGS): status $STATUS, expected $WANT"
+            FAILED=1
+        fi
+    done
+done
+
+[ $FAILED -eq 0 ] && echo "check: all passed"
+exit $FAILED
@@ -0,0 +1,80 @@
+/* Runs a command and prints its wall time in seconds and the peak RSS in
+ * KiB of the largest process it started, the alien process included.
+ * Usage: bench/measure <command> <args>...
+ *
+ * With ptrace the traced loader outlives emu for a moment and is never
+ * waited for by it, so we become a subreaper and collect every
+ * descendant ourselves before looking at RUSAGE_CHILDREN. The exit
+ * status is the command's. */
+
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static void die(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+static double now()
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        die("clock_gettime");
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    struct rusage ru;
+    double start, end;
+    pid_t pid, r;
+    int status, cmdstatus = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: measure <command> <args>...\n");
+        exit(1);
+    }
+
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1)
+        die("prctl");
+
+    start = now();
+
+    pid = fork();
+    if (pid == -1)
+        die("fork");
+    if (pid == 0) {
+        execvp(argv[1], argv + 1);
+        die(argv[1]);
+    }
+
+    /* The command's own exit ends the timing, orphans are only reaped. */
+    end = 0;
+    while ((r = wait(&status)) != -1)
+    {
+        if (r != pid)
+            continue;
+
+        end = now();
+        cmdstatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+    }
+    if (errno != ECHILD)
+        die("wait");
+
+    if (getrusage(RUSAGE_CHILDREN, &ru) == -1)
+        die("getrusage");
+
+    printf("%.6f %ld\n", end - start, ru.ru_maxrss);
+
+    return cmdstatus;
+}
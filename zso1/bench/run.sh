@@ -0,0 +1,42 @@
+#!/bin/sh
+# Compare emulator backends on syscall-heavy alien programs: bench/storm.S
+# and the workloads bench/alienelf.c generates. For each one reports the
+# startup time (a run with 0 iterations), the syscall rate of a full run
+# with the startup taken out, and the peak RSS of the emu or alien process.
+# Usage: bench/run.sh [iterations] (from the zso1 directory, after `make bench`)
+
+ITERS=${1:-100000}
+
+# Workload, syscalls per iteration, iterations.
+WORKLOADS="
+storm 3 $ITERS
+print.alien 1 $ITERS
+getrand.alien 1 $ITERS
+setcursor.alien 1 $ITERS
+game.alien 26 $((ITERS / 26))
+bss.alien 0 65536
+"
+
+printf "%-10s %-8s %10s %10s %12s %10s\n" \
+    workload backend startup time syscalls/s "rss (KiB)"
+
+echo "$WORKLOADS" | while read PROG PER N
+do
+    [ -n "$PROG" ] || continue
+
+    for BACKEND in ptrace seccomp rewrite
+    do
+        EMPTY=$(bench/measure ./emu -b $BACKEND -d headless bench/$PROG 0 \
+                < /dev/null) || { echo "$PROG $BACKEND: emu failed"; exit 1; }
+        FULL=$(bench/measure ./emu -b $BACKEND -d headless bench/$PROG $N \
+               < /dev/null) || { echo "$PROG $BACKEND: emu failed"; exit 1; }
+
+        echo "$EMPTY $FULL" | awk -v w="${PROG%.alien}" -v b="$BACKEND" \
+                                  -v n=$((PER * N)) '{
+            t = $3 - $1
+            rate = n && t > 0 ? sprintf("%.0f", n / t) : "-"
+            printf "%-10s %-8s %8.2fms %9.3fs %12s %10d\n",
+                   w, b, 1000 * $1, $3, rate, $4
+        }'
+    done
+done
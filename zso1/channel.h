@@ -0,0 +1,76 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stdint.h>
+
+#include "screen.h"
+#include "stats.h"
+
+#define CHANNEL_ERRLEN 128
+/* How long the emulator waits for the lock before giving up. */
+#define CHANNEL_LOCK_NS 1000000000ULL
+
+/* Memory shared between the emulator and a loader running the alien
+ * program with the seccomp backend. The loader's SIGSYS handler draws
+ * into `screen` itself and only asks the emulator for keys. */
+struct channel {
+    struct screen screen;
+    /* Spinlock guarding screen, held only for short in-memory updates. */
+    int lock;
+
+    /* Futex bumped by the loader whenever it needs the emulator. */
+    uint32_t kick;
+    /* Futex bumped by the emulator when a requested key is ready. */
+    uint32_t keyseq;
+
+    int keywanted;
+    int key;
+
+    /* Set by present: the framebuffer holds a complete frame. */
+    int fbwanted;
+
+    /* Set up by the emulator before the loader starts: emu -s. */
+    int seeded;
+    uint64_t seed;
+    /* Set up by the emulator: emu -t. The loader then keeps the syscall
+     * counts, latencies and handler time in stats. */
+    int statson;
+    struct stats stats;
+    /* -b rewrite: syscall sites patched so far, see rewritetrap. */
+    uint64_t rewritten;
+
+    /* Set right before the alien process exits. */
+    int ended;
+    char err[CHANNEL_ERRLEN];
+};
+
+static inline void chanlock(struct channel *c)
+{
+    while (__atomic_exchange_n(&c->lock, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&c->lock, __ATOMIC_RELAXED))
+            __builtin_ia32_pause();
+}
+
+/* The emulator's side: the lock is in memory the alien program can write
+ * too, so it is never waited for forever. Zero if it timed out. */
+static inline int chantimedlock(struct channel *c)
+{
+    uint64_t start = nowns();
+    unsigned spins = 0;
+
+    while (__atomic_exchange_n(&c->lock, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&c->lock, __ATOMIC_RELAXED)) {
+            __builtin_ia32_pause();
+            if (++spins % 1024 == 0 && nowns() - start > CHANNEL_LOCK_NS)
+                return 0;
+        }
+
+    return 1;
+}
+
+static inline void chanunlock(struct channel *c)
+{
+    __atomic_store_n(&c->lock, 0, __ATOMIC_RELEASE);
+}
+
+#endif // CHANNEL_H
@@ -0,0 +1,118 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <ncurses.h>
+
+#include "alienos.h"
+#include "display.h"
+#include "emuerr.h"
+#include "screen.h"
+
+#define COL_OFF 1
+
+
+static void definecolors()
+{
+    int i;
+
+    for (i = 0; i < 16; ++i)
+        NERR(init_pair(COL_OFF + i, aliencolors[i].fg, aliencolors[i].bg));
+}
+
+static void exitncurses() { endwin(); }
+
+static void initncurses(const char *record)
+{
+    int x, y;
+
+    if (record)
+        EMUERR("Only the headless display can record");
+
+    initscr();
+    atexit(exitncurses);
+
+    getmaxyx(stdscr, y, x);
+    if (x != MAX_X || y != MAX_Y)
+        EMUERR("The terminal size is not 80x24");
+
+    NERR(noecho());
+    NERR(cbreak());
+    NERR(keypad(stdscr, 1));
+
+    if (!has_colors())
+        EMUERR("The terminal does not support color");
+
+    NERR(start_color());
+    definecolors();
+}
+
+static void clearncurses() { NERR(erase()); }
+
+static void putcells(int x, int y, const uint16_t *cells, int n)
+{
+    int i;
+    int ch, color;
+
+    NERR(move(y, x));
+    for (i = 0; i < n; ++i)
+    {
+        ch = CELL_CH(cells[i]);
+        color = CELL_COLOR(cells[i]) + COL_OFF;
+
+        NERR(attron(COLOR_PAIR(color)));
+        addch(ch); // SUBTLE: not every ERR returned here is actually an error...
+        NERR(attroff(COLOR_PAIR(color)));
+    }
+}
+
+static void flush(int curx, int cury)
+{
+    NERR(move(cury, curx));
+    NERR(refresh());
+}
+
+static int getkey()
+{
+    int ch;
+    int key = 0;
+
+    while (!key)
+    {
+        ch = getch();
+        NERR(ch);
+
+        switch (ch) {
+        case '\n':
+            key = ALIEN_KEY_ENTER;
+            break;
+        case KEY_UP:
+            key = ALIEN_KEY_UP;
+            break;
+        case KEY_LEFT:
+            key = ALIEN_KEY_LEFT;
+            break;
+        case KEY_DOWN:
+            key = ALIEN_KEY_DOWN;
+            break;
+        case KEY_RIGHT:
+            key = ALIEN_KEY_RIGHT;
+            break;
+        default:
+            if (ch >= ALIEN_ASCII_MIN && ch <= ALIEN_ASCII_MAX)
+                key = ch;
+            break;
+        }
+    }
+
+    return key;
+}
+
+const struct display cursesdisplay = {
+    .name = "ncurses",
+    .init = initncurses,
+    .fini = exitncurses,
+    .clear = clearncurses,
+    .putcells = putcells,
+    .flush = flush,
+    .getkey = getkey,
+};
@@ -0,0 +1,30 @@
+#include "display.h"
+
+#define BLACK   0
+#define RED     1
+#define GREEN   2
+#define YELLOW  3
+#define BLUE    4
+#define MAGENTA 5
+#define CYAN    6
+#define WHITE   7
+
+/* The terminal may support 8 colors only, so implemented a workaround... */
+const struct colorpair aliencolors[16] = {
+    { BLACK,   WHITE },   // BLACK
+    { BLUE,    BLACK },   // BLUE
+    { GREEN,   BLACK },   // GREEN
+    { CYAN,    BLACK },   // TURQUOISE
+    { RED,     BLACK },   // RED
+    { MAGENTA, BLACK },   // PINK
+    { YELLOW,  BLACK },   // YELLOW
+    { WHITE,   CYAN },    // LIGHT GRAY
+    { WHITE,   MAGENTA }, // DARK GRAY
+    { BLUE,    WHITE },   // BLUE (BRIGHT)
+    { GREEN,   WHITE },   // GREEN (BRIGHT)
+    { CYAN,    WHITE },   // TURQUOISE(BRIGHT)
+    { RED,     WHITE },   // RED (BRIGHT)
+    { MAGENTA, WHITE },   // PINK (BRIGHT)
+    { YELLOW,  WHITE },   // YELLOW (BRIGHT)
+    { WHITE,   BLACK },   // WHITE
+};
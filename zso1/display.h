@@ -0,0 +1,35 @@
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include <stdint.h>
+
+/* Where the alien screen ends up. Every present is a series of putcells
+ * calls for the cells that changed (see scrdiff) followed by one flush. */
+struct display {
+    const char *name;
+
+    /* record: file to stream frames to, NULL if none. */
+    void (*init)(const char *record);
+    void (*fini)();
+
+    /* Blank the screen, e.g. before the next fork server job. */
+    void (*clear)();
+    void (*putcells)(int x, int y, const uint16_t *cells, int n);
+    void (*flush)(int curx, int cury);
+
+    /* Block until there is a key the alien program understands. */
+    int (*getkey)();
+};
+
+extern const struct display ansidisplay;
+extern const struct display cursesdisplay;
+extern const struct display headlessdisplay;
+
+struct colorpair {
+    int fg, bg;
+};
+
+/* Alien color number -> (foreground, background) in ncurses/ANSI numbering. */
+extern const struct colorpair aliencolors[16];
+
+#endif // DISPLAY_H
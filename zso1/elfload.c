@@ -0,0 +1,376 @@
+#include <sys/mman.h>
+#include <linux/elf.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alienos.h"
+#include "elfload.h"
+#include "emuerr.h"
+#include "framebuf.h"
+
+#define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+
+static void saferead(int fd, void *buf, size_t count, off_t offset)
+{
+    if (pread(fd, buf, count, offset) != (ssize_t) count)
+        EMUERR("saferead");
+}
+
+static void localmmap(uint64_t addr, uint64_t len, int prot, int flags,
+                      int fd, uint64_t offset)
+{
+    void *p;
+
+    p = mmap((void *) addr, len, prot, flags | MAP_FIXED, fd, offset);
+    SYS2ERR(p, "mmap");
+}
+
+static void localmprotect(uint64_t addr, uint64_t len, int prot)
+{
+    int r;
+
+    r = mprotect((void *) addr, len, prot);
+    SYSERR(r, "mprotect");
+}
+
+static void localwrite(uint64_t addr, const void *buf, size_t len)
+{
+    memcpy((void *) addr, buf, len);
+}
+
+static int localmadvise(uint64_t addr, uint64_t len, int advice)
+{
+    return madvise((void *) addr, len, advice);
+}
+
+const struct mapper localmapper = {
+    .mmap = localmmap,
+    .mprotect = localmprotect,
+    .write = localwrite,
+    .madvise = localmadvise,
+};
+
+void elfopen(struct alienelf *e, const char *path)
+{
+    size_t size;
+
+    e->fd = open(path, O_RDONLY);
+    SYSERR(e->fd, "open");
+
+    saferead(e->fd, &e->ehdr, sizeof e->ehdr, 0);
+
+    if (e->ehdr.e_phentsize != sizeof *e->phdrs)
+        EMUERR("Unexpected program header size");
+
+    size = e->ehdr.e_phnum * sizeof *e->phdrs;
+    e->phdrs = malloc(size);
+    if (!e->phdrs) EMUERR("malloc");
+    saferead(e->fd, e->phdrs, size, e->ehdr.e_phoff);
+}
+
+void elfclose(struct alienelf *e)
+{
+    int r;
+
+    r = close(e->fd);
+    SYSERR(r, "close");
+    e->fd = -1;
+}
+
+int elfprot(uint32_t flags)
+{
+    int prot = 0;
+    if (flags & PF_X) prot |= PROT_EXEC;
+    if (flags & PF_W) prot |= PROT_WRITE;
+    if (flags & PF_R) prot |= PROT_READ;
+
+    return prot;
+}
+
+/* Write len zero bytes at addr. */
+static void zero(const struct mapper *m, uint64_t addr, size_t len)
+{
+    static const char zeros[PAGE_SIZE];
+
+    m->write(addr, zeros, len);
+}
+
+/* Bytes of the segment in whole aligned huge pages, the only part
+ * transparent huge pages can back. */
+static uint64_t hugebytes(const Elf64_Phdr *phdr)
+{
+    uint64_t start, end;
+
+    start = (phdr->p_vaddr + HUGE_PAGE_SIZE - 1)
+            & ~(uint64_t) (HUGE_PAGE_SIZE - 1);
+    end = (phdr->p_vaddr + phdr->p_memsz) & ~(uint64_t) (HUGE_PAGE_SIZE - 1);
+
+    return end > start ? end - start : 0;
+}
+
+/* Nonzero if the segment should go in huge pages, why not in *why. */
+static int wanthuge(const struct mapper *m, const Elf64_Phdr *phdr,
+                    int flags, const char **why)
+{
+    if (!(flags & ELF_HUGE))
+        *why = "";
+    else if (!m->madvise)
+        *why = ", no huge pages: cannot madvise";
+    else if (!(phdr->p_flags & PF_W))
+        *why = ", no huge pages: read-only";
+    else if (!hugebytes(phdr))
+        *why = ", no huge pages: no aligned 2 MiB in it";
+    else
+        return 1;
+
+    return 0;
+}
+
+static int populateflag(int flags)
+{
+    return flags & ELF_POPULATE ? MAP_POPULATE : 0;
+}
+
+/* Slow path for segments whose file offset and address disagree on the
+ * offset within a page, and for huge pages: anonymous memory and a copy
+ * of the file bytes. */
+static void copysegment(const struct alienelf *e, const struct mapper *m,
+                        const Elf64_Phdr *phdr, int flags, int huge)
+{
+    int padding;
+    uint64_t pageaddr;
+    size_t memsz;
+    char *buf;
+
+    padding = phdr->p_vaddr % PAGE_SIZE;
+    pageaddr = phdr->p_vaddr - padding;
+    memsz = phdr->p_memsz + padding;
+
+    if (!huge) {
+        m->mmap(pageaddr, memsz, PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | populateflag(flags), -1, 0);
+    }
+    else {
+        /* Populating must wait for the advice, or it uses small pages. */
+        m->mmap(pageaddr, memsz, PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                -1, 0);
+        if (m->madvise(pageaddr, memsz, MADV_HUGEPAGE) == -1)
+            LOGTOFILE("load: %#lx: MADV_HUGEPAGE : %s",
+                      (unsigned long) phdr->p_vaddr, strerror(errno));
+        if ((flags & ELF_POPULATE)
+                && m->madvise(pageaddr, memsz, MADV_POPULATE_WRITE) == -1)
+            LOGTOFILE("load: %#lx: MADV_POPULATE_WRITE : %s",
+                      (unsigned long) phdr->p_vaddr, strerror(errno));
+    }
+
+    buf = malloc(phdr->p_filesz);
+    if (!buf && phdr->p_filesz) EMUERR("malloc");
+    saferead(e->fd, buf, phdr->p_filesz, phdr->p_offset);
+    m->write(phdr->p_vaddr, buf, phdr->p_filesz);
+    free(buf);
+}
+
+/* Map the file part of a segment straight from the file, so its pages are
+ * faulted in lazily and shared through the page cache until written to.
+ * Only the bss tail past the last file page is anonymous memory. */
+static void mapsegment(const struct alienelf *e, const struct mapper *m,
+                       const Elf64_Phdr *phdr, int flags)
+{
+    uint64_t start, fileend, memend;
+    uint64_t bssstart;
+    int prot;
+    const char *why;
+
+    if (wanthuge(m, phdr, flags, &why)) {
+        copysegment(e, m, phdr, flags, 1);
+        if (flags)
+            LOGTOFILE("load: %#lx: %lu KiB copied, %lu KiB in huge pages%s",
+                      (unsigned long) phdr->p_vaddr,
+                      (unsigned long) phdr->p_memsz / 1024,
+                      (unsigned long) hugebytes(phdr) / 1024,
+                      flags & ELF_POPULATE ? ", prefaulted" : "");
+        return;
+    }
+
+    if (flags)
+        LOGTOFILE("load: %#lx: %lu KiB %s%s%s", (unsigned long) phdr->p_vaddr,
+                  (unsigned long) phdr->p_memsz / 1024,
+                  phdr->p_offset % PAGE_SIZE != phdr->p_vaddr % PAGE_SIZE
+                      ? "copied" : "mapped",
+                  why, flags & ELF_POPULATE ? ", prefaulted" : "");
+
+    if (phdr->p_offset % PAGE_SIZE != phdr->p_vaddr % PAGE_SIZE) {
+        copysegment(e, m, phdr, flags, 0);
+        return;
+    }
+
+    prot = elfprot(phdr->p_flags);
+    start = phdr->p_vaddr - phdr->p_vaddr % PAGE_SIZE;
+    fileend = phdr->p_vaddr + phdr->p_filesz;
+    memend = phdr->p_vaddr + phdr->p_memsz;
+    bssstart = (fileend + PAGE_SIZE - 1) & ~(uint64_t) (PAGE_SIZE - 1);
+
+    if (phdr->p_filesz) {
+        /* The rest of the last file page must become zeroed bss. */
+        if (memend > fileend && fileend % PAGE_SIZE)
+            prot |= PROT_WRITE;
+
+        m->mmap(start, bssstart - start, prot,
+                MAP_PRIVATE | populateflag(flags), e->fd,
+                phdr->p_offset - phdr->p_vaddr % PAGE_SIZE);
+
+        if (memend > fileend && fileend % PAGE_SIZE)
+            zero(m, fileend, bssstart - fileend);
+    }
+    else
+        bssstart = start;
+
+    if (memend > bssstart)
+        m->mmap(bssstart, memend - bssstart, PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | populateflag(flags), -1, 0);
+}
+
+/* Nonzero if a PT_LOAD segment already maps all of phdr. */
+static int loaded(const struct alienelf *e, const Elf64_Phdr *phdr)
+{
+    const Elf64_Phdr *phdrs = e->phdrs;
+    int i;
+
+    for (i = 0; i < e->ehdr.e_phnum; ++i)
+        if (phdrs[i].p_type == PT_LOAD
+                && phdrs[i].p_vaddr <= phdr->p_vaddr
+                && phdr->p_vaddr + phdr->p_memsz
+                   <= phdrs[i].p_vaddr + phdrs[i].p_memsz)
+            return 1;
+
+    return 0;
+}
+
+static void mapparams(const struct mapper *m, const Elf64_Phdr *phdr,
+                      int remap)
+{
+    int padding;
+    uint64_t pageaddr;
+    size_t memsz;
+
+    padding = phdr->p_vaddr % PAGE_SIZE;
+    pageaddr = phdr->p_vaddr - padding;
+    memsz = phdr->p_memsz + padding;
+
+    /* Keep whatever a PT_LOAD segment put next to the params. */
+    if (remap)
+        m->mmap(pageaddr, memsz, PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                -1, 0);
+    else
+        m->mprotect(pageaddr, memsz, PROT_READ | PROT_WRITE);
+}
+
+static void mapframebuf(const struct mapper *m, const Elf64_Phdr *phdr,
+                        int fbfd)
+{
+    int mapped = 1;
+
+    if (fbfd == -1)
+        EMUERR("No framebuffer for the alien program");
+    if (phdr->p_vaddr % PAGE_SIZE || phdr->p_filesz
+            || phdr->p_memsz < sizeof ((struct framebuf *) 0)->cells
+            || phdr->p_memsz > PAGE_SIZE)
+        EMUERR("Invalid framebuffer segment");
+
+    m->mmap(phdr->p_vaddr, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fbfd, 0);
+
+    if (pwrite(fbfd, &mapped, sizeof mapped,
+               offsetof(struct framebuf, mapped)) != sizeof mapped)
+        SYSERR(-1, "pwrite framebuffer");
+}
+
+void elfmap(const struct alienelf *e, const struct mapper *m, int fbfd,
+            int flags)
+{
+    const Elf64_Phdr *phdr;
+    int i, pass;
+    int padding;
+    uint64_t pageaddr;
+    size_t memsz;
+
+    /* PT_PARAMS (and PT_FRAMEBUF) go last so no PT_LOAD overwrites them. */
+    for (pass = 0; pass < 2; ++pass)
+    {
+        for (i = 0; i < e->ehdr.e_phnum; ++i)
+        {
+            phdr = &e->phdrs[i];
+
+            switch (phdr->p_type) {
+            case PT_LOAD:
+                if (pass == 0)
+                    mapsegment(e, m, phdr, flags);
+                break;
+
+            case PT_PARAMS:
+                if (pass == 1)
+                    mapparams(m, phdr, !loaded(e, phdr));
+                break;
+
+            case PT_FRAMEBUF:
+                if (pass == 1)
+                    mapframebuf(m, phdr, fbfd);
+                break;
+
+            default:
+                EMUERR("Unexpected segment type");
+                break;
+            }
+
+            if ((phdr->p_type == PT_LOAD) != (pass == 0))
+                continue;
+
+            /* mmap & mprotect address must be aligned to a page boundary */
+            padding = phdr->p_vaddr % PAGE_SIZE;
+            pageaddr = phdr->p_vaddr - padding;
+            memsz = phdr->p_memsz + padding;
+
+            m->mprotect(pageaddr, memsz, elfprot(phdr->p_flags));
+        }
+    }
+}
+
+void elfparams(const struct alienelf *e, const struct mapper *m, int n,
+               const int32_t *params)
+{
+    const Elf64_Phdr *phdr;
+    int i;
+    int padding;
+    uint64_t pageaddr;
+    size_t memsz;
+
+    for (i = 0; i < e->ehdr.e_phnum; ++i)
+    {
+        phdr = &e->phdrs[i];
+        if (phdr->p_type != PT_PARAMS)
+            continue;
+
+        if (n != phdr->p_memsz / 4)
+            EMUERR("Invalid argnum for the alien program");
+
+        padding = phdr->p_vaddr % PAGE_SIZE;
+        pageaddr = phdr->p_vaddr - padding;
+        memsz = phdr->p_memsz + padding;
+
+        m->mprotect(pageaddr, memsz, PROT_READ | PROT_WRITE);
+
+        /* x86_64 is little endian and sizeof (int) == 4 */
+        m->write(phdr->p_vaddr, params, n * sizeof *params);
+
+        m->mprotect(pageaddr, memsz, elfprot(phdr->p_flags));
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef ELFLOAD_H
+#define ELFLOAD_H
+
+#include <linux/elf.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* How an address space gets built: directly by the loader for itself, or
+ * by the emulator in a stopped child through the ptrace remote requests
+ * (see remote.c). Addresses are always fixed, errors exit. madvise is
+ * only a hint and may fail, or be NULL where it cannot be done. */
+struct mapper {
+    void (*mmap)(uint64_t addr, uint64_t len, int prot, int flags, int fd,
+                 uint64_t offset);
+    void (*mprotect)(uint64_t addr, uint64_t len, int prot);
+    void (*write)(uint64_t addr, const void *buf, size_t len);
+    int (*madvise)(uint64_t addr, uint64_t len, int advice);
+};
+
+/* elfmap flags. ELF_HUGE backs writable segments spanning a whole
+ * aligned huge page with anonymous transparent huge pages, their file
+ * bytes copied in. ELF_POPULATE prefaults every segment. */
+#define ELF_HUGE 1
+#define ELF_POPULATE 2
+
+/* An alien program, its headers read once. */
+struct alienelf {
+    int fd;
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr *phdrs;
+};
+
+extern const struct mapper localmapper;
+
+void elfopen(struct alienelf *e, const char *path);
+void elfclose(struct alienelf *e);
+
+/* PROT_* for the PF_* flags of a segment. */
+int elfprot(uint32_t flags);
+
+/* Map every segment, PT_LOAD first so none overwrites PT_PARAMS or
+ * PT_FRAMEBUF. The framebuffer memfd is fbfd, -1 if there is none.
+ * With any ELF_* flags, what was done with each PT_LOAD goes to emulog. */
+void elfmap(const struct alienelf *e, const struct mapper *m, int fbfd,
+            int flags);
+
+/* Fill every PT_PARAMS segment with the n arguments of the program. */
+void elfparams(const struct alienelf *e, const struct mapper *m, int n,
+               const int32_t *params);
+
+#endif // ELFLOAD_H
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/ptrace.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -7,29 +8,301 @@
 #include <errno.h>
 #include <linux/random.h>
 #include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <time.h>
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <ncurses.h>
-
 #include "emuerr.h"
+#include "alienabi.h"
 #include "alienos.h"
+#include "guestmem.h"
+#include "screen.h"
+#include "channel.h"
+#include "display.h"
+#include "elfload.h"
+#include "evlog.h"
+#include "framebuf.h"
+#include "profile.h"
+#include "random.h"
+#include "remote.h"
+#include "render.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "supervise.h"
 
 #define LOADER_PATH "./loader"
 
-#define MAX_X 80
-#define MAX_Y 24
+#define MY_SYS_getrandom 318
 
-#define LONG_SIZE (sizeof (long))
-#define COL_OFF 1
+#define BACKEND_PTRACE 0
+#define BACKEND_SECCOMP 1
+/* Seccomp, with syscall sites rewritten to skip the trap where possible. */
+#define BACKEND_REWRITE 2
 
-#define MY_SYS_getrandom 318
+/* Most arguments a fork server job may pass. */
+#define MAX_JOB_ARGS 1024
+
+/* How often a PT_FRAMEBUF program's screen is looked at by default. */
+#define REFRESH_HZ 60
+
+/* How long the seccomp backend sleeps with nothing to present. Bounds how
+ * late a crashed alien program is noticed. */
+#define IDLE_USEC 100000
 
 typedef struct user_regs_struct reg_t;
 
+/* The shadow screen lives in the channel with the seccomp backend,
+ * ownscreen is then the copy present diffs, see chanview. */
+static struct screen ownscreen;
+static struct screen *screen = &ownscreen;
+static struct channel *chan;
+
+static const struct display *display = &ansidisplay;
+
+static struct randpool pool;
+static int seeded;
+static uint64_t seed;
+
+/* Signals the emulation loop waits for: child stops, stats dumps,
+ * framebuffer refreshes and profiler samples. */
+static sigset_t waitset;
+static struct timespec lastpresent;
+
+/* emu -t: where to dump stats at exit and on SIGUSR1. */
+static const char *statsfile;
+static struct stats stats;
+static const char *backendname = "ptrace";
+static volatile sig_atomic_t dumpwanted;
+
+/* Mapped when the alien program has a PT_FRAMEBUF segment. It is copied
+ * into the screen refreshhz times a second (never if 0) and on present. */
+static struct framebuf *fb;
+static long refreshhz = REFRESH_HZ;
+static uint64_t lastrefresh;
+
+/* emu -p: sample the alien program profilehz times a second. A sample
+ * is taken by stopping it with SIGSTOP, sent only while profchild runs
+ * emulateptrace. */
+static const char *profilefile;
+static long profilehz = PROFILE_HZ;
+static pid_t profchild = -1;
+static int stopsent;
+
+/* emu -e: every syscall served goes into this ring, see evlog.h. */
+static struct evring *evring;
+
+/* emu -H and -E: ELF_HUGE and ELF_POPULATE for loading the program. */
+static int mapflags;
+
+/* emu -C: snapshot the program after its snapat-th syscall (counted from
+ * the start or the resumed snapshot, 0 for never) and after the one
+ * following each SIGQUIT. emu -R: resume resumefile. */
+static const char *snapfile;
+static uint64_t snapat;
+static int snapwanted;
+static const char *resumefile;
+static const char *progpath;
+
+
+/* A timestamp for stats, or 0 when nobody asked for them. */
+static uint64_t statnow()
+{
+    return statsfile ? nowns() : 0;
+}
+
+/* ptrace, with its time accounted for. */
+static long tptrace(enum __ptrace_request req, pid_t pid, void *addr,
+                    void *data)
+{
+    uint64_t start;
+    long r;
+
+    start = statnow();
+    r = ptrace(req, pid, addr, data);
+    stats.ptracens += statnow() - start;
+
+    return r;
+}
+
+/* Overwrite the stats file with what has been collected so far. */
+static void dumpstats()
+{
+    FILE *f;
+
+    /* The loader keeps the syscall stats itself with seccomp. */
+    if (chan) {
+        memcpy(stats.sys, chan->stats.sys, sizeof stats.sys);
+        stats.handlerns = chan->stats.handlerns;
+        stats.rewritten = __atomic_load_n(&chan->rewritten, __ATOMIC_RELAXED);
+    }
+    else
+        renderstats(&stats);
+
+    f = fopen(statsfile, "w");
+    if (!f) SYSERR(-1, "fopen %s", statsfile);
+    statsdump(&stats, backendname, f);
+    fclose(f);
+}
+
+static void wantdump(int sig) { (void) sig; dumpwanted = 1; }
+
+static void dumpprofile() { profdump(profilefile); }
+
+static void lockchan()
+{
+    if (!chantimedlock(chan))
+        EMUERR("The alien program holds on to its screen");
+}
+
+/* Every change to the screen goes between these. The loader's SIGSYS
+ * handler shares it with seccomp, the render thread with ptrace. */
+static void scrbegin()
+{
+    if (chan)
+        lockchan();
+    else
+        renderbegin();
+}
+
+static void scrend()
+{
+    if (chan)
+        chanunlock(chan);
+    else
+        renderend();
+}
+
+/* Copy what the alien program drew into its framebuffer to the screen. */
+static void fbsync()
+{
+    if (!fb)
+        return;
+
+    scrbegin();
+    scrcopy(screen, fb->cells);
+    scrend();
+}
+
+/* Raise sig hz times a second, for waitchild. */
+static void starttimer(int sig, long hz)
+{
+    struct sigevent sev;
+    struct itimerspec its;
+    timer_t timer;
+    int r;
+
+    memset(&sev, 0, sizeof sev);
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = sig;
+    r = timer_create(CLOCK_MONOTONIC, &sev, &timer);
+    SYSERR(r, "timer_create");
+
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 1000000000 / hz;
+    its.it_value = its.it_interval;
+    r = timer_settime(timer, 0, &its, NULL);
+    SYSERR(r, "timer_settime");
+}
+
+/* The alien process can write its channel as well as its SIGSYS handler
+ * can, so present never diffs chan->screen in place. The cells and the
+ * dirty marks are taken out of it once, under the lock, into ownscreen,
+ * which keeps what is shown to ourselves, and checked there. */
+static void chanview()
+{
+    struct screen *s = &chan->screen;
+    int y;
+
+    lockchan();
+    memcpy(ownscreen.cells, s->cells, sizeof ownscreen.cells);
+    memcpy(ownscreen.dirtyfrom, s->dirtyfrom, sizeof ownscreen.dirtyfrom);
+    memcpy(ownscreen.dirtyto, s->dirtyto, sizeof ownscreen.dirtyto);
+    ownscreen.dirty = s->dirty;
+    ownscreen.curx = s->curx;
+    ownscreen.cury = s->cury;
+    ownscreen.curdirty = s->curdirty;
+
+    for (y = 0; y < MAX_Y; ++y)
+    {
+        s->dirtyfrom[y] = MAX_X;
+        s->dirtyto[y] = 0;
+    }
+    s->dirty = 0;
+    s->curdirty = 0;
+    chanunlock(chan);
+
+    for (y = 0; y < MAX_Y; ++y)
+    {
+        if (ownscreen.dirtyfrom[y] >= ownscreen.dirtyto[y])
+            continue;
+        if (ownscreen.dirtyfrom[y] < 0 || ownscreen.dirtyto[y] > MAX_X)
+            EMUERR("Garbage in the alien screen");
+    }
+    if (ownscreen.curx < 0 || ownscreen.curx >= MAX_X
+        || ownscreen.cury < 0 || ownscreen.cury >= MAX_Y)
+        EMUERR("Garbage in the alien screen");
+}
+
+/* Bring the display up to date with the shadow screen in one flush.
+ * For seccomp, ptrace has the render thread do it. */
+static void present()
+{
+    int r;
+    uint64_t start;
+
+    /* Also before getkey and end, take the framebuffer along. */
+    fbsync();
+    chanview();
+
+    if (scrdirty(&ownscreen)) {
+        start = statnow();
+
+        scrdiff(&ownscreen, display->putcells);
+        display->flush(ownscreen.curx, ownscreen.cury);
+
+        stats.displayns += statnow() - start;
+        ++stats.presents;
+    }
+
+    r = clock_gettime(CLOCK_MONOTONIC, &lastpresent);
+    SYSERR(r, "clock_gettime");
+}
+
+/* Microseconds since the terminal was last brought up to date. */
+static long sincepresent()
+{
+    struct timespec now;
+    int r;
+
+    r = clock_gettime(CLOCK_MONOTONIC, &now);
+    SYSERR(r, "clock_gettime");
+
+    return (now.tv_sec - lastpresent.tv_sec) * 1000000
+         + (now.tv_nsec - lastpresent.tv_nsec) / 1000;
+}
+
+/* Have everything drawn so far on the display before returning. */
+static void presentnow()
+{
+    if (chan) {
+        present();
+        return;
+    }
+
+    fbsync();
+    rendersync(0);
+}
+
 
 /**ALIENOS SYSCALL ABI**
  * Syscall number: rax
@@ -38,164 +311,192 @@ typedef struct user_regs_struct reg_t;
  */
 
 /* void noreturn end(int status) */
-static void end(pid_t child, reg_t regs)
+static int end(pid_t child, reg_t regs)
 {
     (void) child;
+    const char *err;
     int status;
 
-    status = (int) regs.rdi;
-    if (status < 0 || status > 63)
-        EMUERR("end: invalid status");
+    err = abiend(regs.rdi, &status);
+    if (err) EMUERR("%s", err);
 
-    exit(status);
+    presentnow();
+
+    return status;
+}
+
+static long hostrandom(void *buf, size_t len)
+{
+    return syscall(MY_SYS_getrandom, buf, len, 0);
 }
 
 /* uint32_t getrand() */
-static void getrand(pid_t child, reg_t regs)
+static uint32_t getrand(pid_t child, reg_t regs)
 {
+    const char *err;
+    uint32_t rand;
     long r;
-    uint32_t randval;
-
-    r = syscall(MY_SYS_getrandom, &randval, 4, 0);
-    SYSERR(r, "getrandom");
 
-    regs.rax = randval;
+    err = abigetrand(&pool, hostrandom, &rand);
+    if (err) EMUERR("%s", err);
+    regs.rax = rand;
 
-    r = ptrace(PTRACE_SETREGS, child, NULL, &regs);
+    r = tptrace(PTRACE_SETREGS, child, NULL, &regs);
     SYSERR(r, "PTRACE_SETREGS");
+
+    return regs.rax;
 }
 
-/* int getkey() */
-static void getkey(pid_t child, reg_t regs)
+/* Block until the user presses a key the alien program understands. */
+static int readkey()
 {
-    long r;
-    int ch;
-    int key = 0;
+    uint64_t start;
+    int key;
 
-    while (!key)
-    {
-        ch = getch();
-        NERR(ch);
+    /* This may block for long, show the alien what it drew so far. */
+    presentnow();
 
-        switch (ch) {
-        case '\n':
-            key = ALIEN_KEY_ENTER;
-            break;
-        case KEY_UP:
-            key = ALIEN_KEY_UP;
-            break;
-        case KEY_LEFT:
-            key = ALIEN_KEY_LEFT;
-            break;
-        case KEY_DOWN:
-            key = ALIEN_KEY_DOWN;
-            break;
-        case KEY_RIGHT:
-            key = ALIEN_KEY_RIGHT;
-            break;
-        default:
-            if (ch >= ALIEN_ASCII_MIN && ch <= ALIEN_ASCII_MAX)
-                key = ch;
-            break;
-        }
-    }
+    start = statnow();
+    key = display->getkey();
+    stats.keywaitns += statnow() - start;
+
+    return key;
+}
 
-    regs.rax = key;
-    r = ptrace(PTRACE_SETREGS, child, NULL, &regs);
+/* int getkey() */
+static int getkey(pid_t child, reg_t regs)
+{
+    long r;
+
+    regs.rax = readkey();
+    r = tptrace(PTRACE_SETREGS, child, NULL, &regs);
     SYSERR(r, "PTRACE_SETREGS");
+
+    return regs.rax;
 }
 
 /* void print(int x, int y, uint16_t *chars, int n) */
 static void print(pid_t child, reg_t regs)
 {
-    static long buf[MAX_X];
-    static uint16_t chars[MAX_X];
+    static struct abiprint p;
 
-    int x, y, n;
-    uint64_t addr;
-    uint64_t len;
-    int padding1, padding2;
-    long *start;
-    uint64_t longn;
-    uint64_t i;
-    long r;
-    int oldx, oldy;
-    int ch, color;
+    struct iovec local, remote;
+    const char *err;
+    uint64_t start;
 
-    x = (int) regs.rdi;
-    y = (int) regs.rsi;
-    n = (int) regs.r10;
-    addr = (uint64_t) regs.rdx;
+    err = abiprintargs(regs.rdi, regs.rsi, regs.rdx, regs.r10, &p,
+                       &local, &remote);
+    if (err) EMUERR("%s", err);
 
-    if (y < 0 || y >= MAX_Y || x < 0 || n <= 0 || x + n > MAX_X)
-        EMUERR("print: invalid x or y or n");
+    start = statnow();
+    readmemv(child, &local, &remote, 1);
+    stats.ptracens += statnow() - start;
 
-    /* Make sure reads are naturally aligned with long type. */
-    len = n * sizeof (uint16_t);
+    scrbegin();
+    abiprint(screen, &p);
+    scrend();
+}
 
-    padding1 = addr % LONG_SIZE;
-    padding2 = LONG_SIZE - (addr + len) % LONG_SIZE;
+/* void printspans(const struct alienspan *spans, int n) */
+static void printspans(pid_t child, reg_t regs)
+{
+    static struct abispans p;
+    static struct iovec local[ALIEN_MAX_SPANS], remote[ALIEN_MAX_SPANS];
 
-    start = (long *) (addr - padding1);
-    longn = (len + padding1 + padding2) / LONG_SIZE;
+    const char *err;
+    uint64_t start;
 
-    for (i = 0; i < longn; ++i)
-    {
-        errno = 0;
-        r = ptrace(PTRACE_PEEKDATA, child, start + i, NULL);
-        if (errno) SYSERR(-1, "PTRACE_PEEKDATA");
+    err = abispansargs(regs.rdi, regs.rsi, &p, local, remote);
+    if (err) EMUERR("%s", err);
 
-        buf[i] = r;
-    }
-    memcpy(chars, (char *) buf + padding1, len);
+    start = statnow();
+    readmemv(child, local, remote, 1);
+    stats.ptracens += statnow() - start;
 
-    getyx(stdscr, oldy, oldx);
-    NERR(move(y, x));
-    for (i = 0; i < n; ++i)
-    {
-        ch = chars[i] & 0xFF;
-        color = (chars[i] >> 8 & 7) + COL_OFF;
+    err = abispanschars(&p, local, remote);
+    if (err) EMUERR("%s", err);
 
-        NERR(attron(COLOR_PAIR(color)));
-        addch(ch); // SUBTLE: not every ERR returned here is actually an error...
-        NERR(attroff(COLOR_PAIR(color)));
-    }
-    NERR(move(oldy, oldx));
-    NERR(refresh());
+    start = statnow();
+    readmemv(child, local, remote, p.n);
+    stats.ptracens += statnow() - start;
+
+    scrbegin();
+    abispans(screen, &p);
+    scrend();
+}
+
+/* void present() */
+static void presentfb(pid_t child, reg_t regs)
+{
+    (void) child;
+    (void) regs;
+
+    /* Shown within a frame, like print. */
+    fbsync();
 }
 
 /* void setcursor(int x, int y) */
 static void setcursor(pid_t child, reg_t regs)
 {
     (void) child;
+    const char *err;
     int x, y;
 
-    x = (int) regs.rdi;
-    y = (int) regs.rsi;
-    if (x < 0 || x >= MAX_X || y < 0 || y >= MAX_Y)
-        EMUERR("setcursor: invalid x or y");
+    err = abicursor(regs.rdi, regs.rsi, &x, &y);
+    if (err) EMUERR("%s", err);
+
+    scrbegin();
+    scrcursor(screen, x, y);
+    scrend();
+}
+
+/* Put the syscall in regs, served from start until now, in the event
+ * log if there is one. */
+static void logsyscall(pid_t child, const reg_t *regs, uint64_t start,
+                       int64_t result)
+{
+    struct evrecord ev;
+
+    if (!evring)
+        return;
 
-    NERR(move(y, x));
-    NERR(refresh());
+    ev.ns = start;
+    ev.durns = nowns() - start;
+    ev.pid = child;
+    ev.nr = regs->orig_rax;
+    ev.args[0] = regs->rdi;
+    ev.args[1] = regs->rsi;
+    ev.args[2] = regs->rdx;
+    ev.args[3] = regs->r10;
+    ev.result = result;
+    evput(evring, &ev);
 }
 
-void handlesyscall(pid_t child)
+/* Returns the exit status once the alien program calls end, -1 before.
+ * The syscall number goes to nr. */
+int handlesyscall(pid_t child, long *nr)
 {
     reg_t regs;
+    uint64_t start;
+    int64_t result = 0;
     long r;
 
-    r = ptrace(PTRACE_GETREGS, child, NULL, &regs);
+    r = tptrace(PTRACE_GETREGS, child, NULL, &regs);
     SYSERR(r, "PTRACE_GETREGS");
 
+    *nr = regs.orig_rax;
+    start = evring ? nowns() : 0;
+
     switch (regs.orig_rax) {
     case 0:
-        end(child, regs);
-        break;
+        /* Logged on the way in, like the seccomp backend has to. */
+        logsyscall(child, &regs, start, 0);
+        return end(child, regs);
     case 1:
-        getrand(child, regs);
+        result = getrand(child, regs);
         break;
     case 2:
-        getkey(child, regs);
+        result = getkey(child, regs);
         break;
     case 3:
         print(child, regs);
@@ -203,77 +504,506 @@ void handlesyscall(pid_t child)
     case 4:
         setcursor(child, regs);
         break;
+    case 5:
+        printspans(child, regs);
+        break;
+    case 6:
+        presentfb(child, regs);
+        break;
     default:
         EMUERR("invalid syscall number");
         break;
     }
+
+    logsyscall(child, &regs, start, result);
+
+    return -1;
 }
 
-static void definecolors()
+static void initwait()
 {
-    /* The terminal may support 8 colors only, so implemented a workaround... */
+    int r;
+
+    r = sigemptyset(&waitset);
+    SYSERR(r, "sigemptyset");
+    r = sigaddset(&waitset, SIGCHLD);
+    SYSERR(r, "sigaddset");
+    if (statsfile) {
+        r = sigaddset(&waitset, SIGUSR1);
+        SYSERR(r, "sigaddset");
+    }
+    if (fb) {
+        r = sigaddset(&waitset, SIGUSR2);
+        SYSERR(r, "sigaddset");
+    }
+    if (profilefile) {
+        r = sigaddset(&waitset, SIGPROF);
+        SYSERR(r, "sigaddset");
+    }
+    if (snapfile) {
+        r = sigaddset(&waitset, SIGQUIT);
+        SYSERR(r, "sigaddset");
+    }
 
-    NERR(init_pair(COL_OFF + 0,  COLOR_BLACK,   COLOR_WHITE)); // BLACK
-    NERR(init_pair(COL_OFF + 1,  COLOR_BLUE,    COLOR_BLACK)); // BLUE
-    NERR(init_pair(COL_OFF + 2,  COLOR_GREEN,   COLOR_BLACK)); // GREEN
-    NERR(init_pair(COL_OFF + 3,  COLOR_CYAN,    COLOR_BLACK)); // TURQUOISE
-    NERR(init_pair(COL_OFF + 4,  COLOR_RED,     COLOR_BLACK)); // RED
-    NERR(init_pair(COL_OFF + 5,  COLOR_MAGENTA, COLOR_BLACK)); // PINK
-    NERR(init_pair(COL_OFF + 6,  COLOR_YELLOW,  COLOR_BLACK)); // YELLOW
-    NERR(init_pair(COL_OFF + 7,  COLOR_WHITE,   COLOR_CYAN));  // LIGHT GRAY
-    NERR(init_pair(COL_OFF + 8,  COLOR_WHITE,   COLOR_MAGENTA)); // DARK GRAY
-    NERR(init_pair(COL_OFF + 9,  COLOR_BLUE,    COLOR_WHITE)); // BLUE (BRIGHT)
-    NERR(init_pair(COL_OFF + 10, COLOR_GREEN,   COLOR_WHITE)); // GREEN (BRIGHT)
-    NERR(init_pair(COL_OFF + 11, COLOR_CYAN,    COLOR_WHITE)); // TURQUOISE(BRIGHT)
-    NERR(init_pair(COL_OFF + 12, COLOR_RED,     COLOR_WHITE)); // RED (BRIGHT)
-    NERR(init_pair(COL_OFF + 13, COLOR_MAGENTA, COLOR_WHITE)); // PINK (BRIGHT)
-    NERR(init_pair(COL_OFF + 14, COLOR_YELLOW,  COLOR_WHITE)); // YELLOW (BRIGHT)
-    NERR(init_pair(COL_OFF + 15, COLOR_WHITE,   COLOR_BLACK)); // WHITE
+    /* Keep them pending so sigwaitinfo can pick them up. */
+    r = sigprocmask(SIG_BLOCK, &waitset, NULL);
+    SYSERR(r, "sigprocmask");
+
+    if (fb && refreshhz)
+        starttimer(SIGUSR2, refreshhz);
+    if (profilefile)
+        starttimer(SIGPROF, profilehz);
 }
 
-static void exitncurses() { endwin(); }
+/* waitpid for the child, handling the signals in waitset meanwhile. */
+static void waitchild(pid_t child, int *status)
+{
+    int r;
+
+    for (;;)
+    {
+        r = waitpid(child, status, __WALL | WNOHANG);
+        SYSERR(r, "waitpid");
+        if (r == child)
+            return;
+
+        r = sigwaitinfo(&waitset, NULL);
+        if (r == -1 && errno == EINTR)
+            continue;
+        SYSERR(r, "sigwaitinfo");
 
-static void initncurses()
+        if (r == SIGUSR1)
+            dumpstats();
+        else if (r == SIGUSR2)
+            fbsync();
+        else if (r == SIGQUIT)
+            snapwanted = 1;
+        else if (r == SIGPROF && profchild != -1 && !stopsent) {
+            /* Sampled once the stop shows up in emulateptrace. */
+            r = kill(profchild, SIGSTOP);
+            SYSERR(r, "kill");
+            stopsent = 1;
+        }
+    }
+}
+
+/* Emulate every syscall the traced alien program stops at, until it
+ * calls end. Returns its exit status, the child is left stopped. */
+static int emulateptrace(pid_t child)
 {
-    int x, y;
+    int r;
+    int status;
+    long nr = -1;
+    uint64_t stopped = 0, start, others;
+    uint64_t served = 0;
 
-    initscr();
-    atexit(exitncurses);
+    profchild = profilefile ? child : -1;
+    stopsent = 0;
 
-    getmaxyx(stdscr, y, x);
-    if (x != MAX_X || y != MAX_Y)
-        EMUERR("The terminal size is not 80x24");
+    for (;;)
+    {
+        /* Latency counts from the stop until the alien runs again. */
+        if (nr != -1)
+            statsrecord(&stats, nr, statnow() - stopped);
 
-    NERR(noecho());
-    NERR(cbreak());
-    NERR(keypad(stdscr, 1));
+        r = tptrace(PTRACE_SYSEMU, child, NULL, NULL);
+        SYSERR(r, "PTRACE_SYSEMU");
 
-    if (!has_colors())
-        EMUERR("The terminal does not support color");
+        waitchild(child, &status);
+        stopped = statnow();
 
-    NERR(start_color());
-    definecolors();
+        if (WIFSIGNALED(status))
+            EMUERR("The alien program was terminated by a signal");
+
+        if (WIFSTOPPED(status)) {
+            int signum;
+
+            signum = WSTOPSIG(status);
+
+            /* Our own SIGSTOP, resuming with SYSEMU swallows it. */
+            if (signum == SIGSTOP && stopsent) {
+                stopsent = 0;
+                profsample(child);
+                nr = -1;
+                continue;
+            }
+
+            if (signum != (SIGTRAP | 0x80))
+                EMUERR("An unexpected signal delivered to the alien program");
+
+            others = stats.ptracens + stats.keywaitns;
+            start = statnow();
+            r = handlesyscall(child, &nr);
+            stats.handlerns += statnow() - start
+                - (stats.ptracens + stats.keywaitns - others);
+            if (r != -1) {
+                statsrecord(&stats, nr, statnow() - stopped);
+                profchild = -1;
+                return r;
+            }
+
+            ++served;
+            if (snapfile && (snapwanted || served == snapat)) {
+                snapwanted = 0;
+                fbsync();
+                snapsave(snapfile, child, progpath, screen, &pool);
+            }
+        }
+    }
 }
 
-int main(int argc, char *argv[])
+/* Start a job on a fresh screen. */
+static void newjob()
+{
+    scrbegin();
+    scrinit(screen);
+    scrend();
+    rendersync(1);
+
+    /* The copies share the server's framebuffer. */
+    if (fb)
+        memset(fb->cells, 0xFF, sizeof fb->cells);
+
+    if (seeded)
+        randseed(&pool, seed);
+}
+
+static void safewrite(int fd, const void *buf, size_t count)
+{
+    if (write(fd, buf, count) != (ssize_t) count)
+        SYSERR(-1, "write");
+}
+
+/* Read exactly count bytes, 0 on end of file. */
+static int saferecv(int fd, void *buf, size_t count)
 {
+    ssize_t r;
+    size_t done = 0;
+
+    while (done < count)
+    {
+        r = read(fd, (char *) buf + done, count - done);
+        if (r == -1 && errno == EINTR)
+            continue;
+        SYSERR(r, "read");
+        if (r == 0)
+            return 0;
+
+        done += r;
+    }
+
+    return 1;
+}
+
+/* Run the alien program once per line of jobfile, each line holding that
+ * run's arguments. The loader maps the program once and forks a copy of
+ * itself per job (see serve in loader.c), which we attach to. */
+static void forkserver(pid_t server, int sock, const char *jobfile)
+{
+    FILE *jobs;
+    char *line = NULL;
+    size_t linecap = 0;
+    int32_t params[MAX_JOB_ARGS];
+    int32_t n;
+    int32_t pid;
+    char *arg, *save;
+    int *statuses = NULL;
+    int njobs = 0;
+    int status;
+    int i;
+    long r;
+
+    jobs = fopen(jobfile, "r");
+    if (!jobs) SYSERR(-1, "fopen %s", jobfile);
+
+    initwait();
+    renderstart(screen, display);
+
+    while (getline(&line, &linecap, jobs) != -1)
+    {
+        n = 0;
+        for (arg = strtok_r(line, " \t\n", &save); arg;
+             arg = strtok_r(NULL, " \t\n", &save))
+        {
+            if (n == MAX_JOB_ARGS)
+                EMUERR("job %d: too many arguments", njobs + 1);
+            params[n++] = atoi(arg);
+        }
+
+        safewrite(sock, &n, sizeof n);
+        safewrite(sock, params, n * sizeof *params);
+        if (!saferecv(sock, &pid, sizeof pid))
+            EMUERR("The fork server is gone");
+        if (pid == -1)
+            EMUERR("The fork server could not fork");
+
+        /* The copy stops itself once its params are written. */
+        r = ptrace(PTRACE_SEIZE, pid, NULL,
+                   PTRACE_O_EXITKILL | PTRACE_O_TRACESYSGOOD);
+        SYSERR(r, "PTRACE_SEIZE");
+
+        waitchild(pid, &status);
+        if (WIFEXITED(status))
+            EMUERR("job %d: the loader exited with %d", njobs + 1,
+                   WEXITSTATUS(status));
+        if (!WIFSTOPPED(status))
+            EMUERR("job %d: the loader was terminated by a signal",
+                   njobs + 1);
+
+        newjob();
+
+        statuses = realloc(statuses, (njobs + 1) * sizeof *statuses);
+        if (!statuses) EMUERR("realloc");
+        statuses[njobs++] = emulateptrace(pid);
+
+        r = kill(pid, SIGKILL);
+        SYSERR(r, "kill");
+        do {
+            waitchild(pid, &status);
+        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+    }
+
+    fclose(jobs);
+    free(line);
+
+    /* Closing the socket makes the server exit. */
+    r = close(sock);
+    SYSERR(r, "close");
+    r = waitpid(server, &status, __WALL);
+    SYSERR(r, "waitpid");
+
+    renderstop();
+    display->fini();
+    for (i = 0; i < njobs; ++i)
+        printf("job %d: %d\n", i + 1, statuses[i]);
+
+    exit(0);
+}
+
+static struct channel *newchannel(int *fd)
+{
+    struct channel *c;
+    int r;
+
+    /* Inherited by the loader through execve. */
+    *fd = memfd_create("alienos-channel", 0);
+    SYSERR(*fd, "memfd_create");
+
+    r = ftruncate(*fd, sizeof *c);
+    SYSERR(r, "ftruncate");
+
+    c = mmap(NULL, sizeof *c, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    SYS2ERR(c, "mmap channel");
+
+    return c;
+}
+
+static void wakechild(int sig) { (void) sig; }
+
+/* Nonzero if the framebuffer is due for a look, otherwise *usec is
+ * lowered to when it will be. Without a timer, for emulatetrapped. */
+static int refreshdue(long *usec)
+{
+    long left;
+    uint64_t now;
+
+    if (!fb || !refreshhz)
+        return 0;
+
+    now = nowns();
+    left = 1000000 / refreshhz - (long) (now - lastrefresh) / 1000;
+    if (left <= 0) {
+        lastrefresh = now;
+        return 1;
+    }
+
+    if (*usec > left)
+        *usec = left;
+    return 0;
+}
+
+/* The alien process is gone, finish the way it asked us to. */
+static void trappedexit(int status)
+{
+    if (WIFSIGNALED(status))
+        EMUERR("The alien program was terminated by a signal");
+
+    if (chan->err[0])
+        EMUERR("%.*s", CHANNEL_ERRLEN, chan->err);
+
+    /* rewrite logged how many sites qualify, this is how many were hit. */
+    if (!strcmp(backendname, "rewrite"))
+        LOGTOFILE("rewrite: %llu syscall sites rewritten",
+                  (unsigned long long) chan->rewritten);
+
+    present();
+    exit(WEXITSTATUS(status));
+}
+
+/* The alien program runs on its own and serves its syscalls in a SIGSYS
+ * handler (see trap.c). We only present the screen it draws into the
+ * channel and answer getkey requests. */
+static void emulatetrapped(pid_t child)
+{
+    struct sigaction sa;
+    struct timespec ts;
+    uint32_t kick;
+    long usec, frame;
+    int status;
     int r;
+
+    /* Interrupt the futex wait when the alien process dies. */
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = wakechild;
+    r = sigaction(SIGCHLD, &sa, NULL);
+    SYSERR(r, "sigaction");
+
+    if (statsfile) {
+        /* Noticed within IDLE_USEC, without breaking a getkey read. */
+        sa.sa_handler = wantdump;
+        sa.sa_flags = SA_RESTART;
+        r = sigaction(SIGUSR1, &sa, NULL);
+        SYSERR(r, "sigaction");
+    }
+
+
+    r = kill(child, SIGCONT);
+    SYSERR(r, "kill");
+
+    for (;;)
+    {
+        kick = __atomic_load_n(&chan->kick, __ATOMIC_SEQ_CST);
+
+        if (dumpwanted) {
+            dumpwanted = 0;
+            dumpstats();
+        }
+
+
+        if (__atomic_load_n(&chan->ended, __ATOMIC_SEQ_CST)) {
+            r = waitpid(child, &status, __WALL);
+            SYSERR(r, "waitpid");
+            trappedexit(status);
+        }
+
+        if (__atomic_load_n(&chan->keywanted, __ATOMIC_SEQ_CST)) {
+            chan->keywanted = 0;
+            chan->key = readkey();
+
+            __atomic_add_fetch(&chan->keyseq, 1, __ATOMIC_SEQ_CST);
+            r = syscall(SYS_futex, &chan->keyseq, FUTEX_WAKE, 1, NULL);
+            SYSERR(r, "FUTEX_WAKE");
+            continue;
+        }
+
+        r = waitpid(child, &status, __WALL | WNOHANG);
+        SYSERR(r, "waitpid");
+        if (r == child)
+            trappedexit(status);
+
+        usec = IDLE_USEC;
+        if (__atomic_exchange_n(&chan->fbwanted, 0, __ATOMIC_SEQ_CST)
+                | refreshdue(&usec))
+            fbsync();
+
+        if (scrdirty(screen)) {
+            frame = FRAME_USEC - sincepresent();
+            if (frame <= 0) {
+                present();
+                continue;
+            }
+            if (usec > frame)
+                usec = frame;
+        }
+
+        ts.tv_sec = usec / 1000000;
+        ts.tv_nsec = usec % 1000000 * 1000;
+        r = syscall(SYS_futex, &chan->kick, FUTEX_WAIT, kick, &ts);
+        if (r == -1 && (errno == EAGAIN || errno == ETIMEDOUT
+                        || errno == EINTR))
+            continue;
+        SYSERR(r, "FUTEX_WAIT");
+    }
+}
+
+/* Exec the loader with its options in front of the program and its args. */
+static void execloader(char *prog[], int n, int backend, int chanfd,
+                       int serverfd, int fbfd, int evfd)
+{
+    char chanarg[16];
+    char serverarg[16];
+    char fbarg[16];
+    char evarg[16];
+    char **argv;
+    int i = 0;
+    int r;
+
+    argv = malloc((n + 15) * sizeof *argv);
+    if (!argv) EMUERR("malloc");
+
+    argv[i++] = LOADER_PATH;
+    if (chanfd != -1) {
+        snprintf(chanarg, sizeof chanarg, "%d", chanfd);
+        argv[i++] = "-c";
+        argv[i++] = chanarg;
+    }
+    if (backend == BACKEND_REWRITE)
+        argv[i++] = "-r";
+    if (mapflags & ELF_HUGE)
+        argv[i++] = "-H";
+    if (mapflags & ELF_POPULATE)
+        argv[i++] = "-E";
+    if (resumefile) {
+        argv[i++] = "-R";
+        argv[i++] = (char *) resumefile;
+    }
+    if (fbfd != -1) {
+        snprintf(fbarg, sizeof fbarg, "%d", fbfd);
+        argv[i++] = "-F";
+        argv[i++] = fbarg;
+    }
+    if (evfd != -1) {
+        /* Only the SIGSYS handler logs from inside the loader. */
+        r = fcntl(evfd, F_SETFD, 0);
+        SYSERR(r, "fcntl");
+        snprintf(evarg, sizeof evarg, "%d", evfd);
+        argv[i++] = "-e";
+        argv[i++] = evarg;
+    }
+    if (serverfd != -1) {
+        /* Jobs bring their own arguments, only pass the program. */
+        r = fcntl(serverfd, F_SETFD, 0);
+        SYSERR(r, "fcntl");
+        snprintf(serverarg, sizeof serverarg, "%d", serverfd);
+        argv[i++] = "-f";
+        argv[i++] = serverarg;
+        n = 1;
+    }
+
+    memcpy(argv + i, prog, n * sizeof *argv);
+    argv[i + n] = NULL;
+
+    r = execvp(argv[0], argv);
+    SYSERR(r, "execvp");
+}
+
+/* Fork and exec the loader and wait until it has loaded the program and
+ * stopped itself. */
+static pid_t startloader(char *prog[], int n, int backend, int chanfd,
+                         int serverfd, int fbfd, int evfd)
+{
     pid_t child;
     int status;
+    int r;
 
     child = fork();
     SYSERR(child, "fork");
 
     if (child == 0)
-    {
-        argv[0] = LOADER_PATH;
-
-        r = execvp(argv[0], argv);
-        SYSERR(r, "execvp");
-    }
+        execloader(prog, n, backend, chanfd, serverfd, fbfd, evfd);
 
-    /* Wait until loader does TRACEME and raises SIGSTOP. */
-    r = waitpid(child, &status, __WALL);
+    /* Wait until loader is done and raises SIGSTOP. */
+    r = waitpid(child, &status, __WALL | WUNTRACED);
     SYSERR(r, "1. waitpid");
 
     /* If the loader exited because of an error, propagate it. */
@@ -284,37 +1014,268 @@ int main(int argc, char *argv[])
         EMUERR("The loader was terminated by a signal");
 
     /* Assume the loader was stopped by its own SIGSTOP. */
-    if (WIFSTOPPED(status))
+    if (!WIFSTOPPED(status))
+        EMUERR("Impossible...");
+
+    return child;
+}
+
+/* Give the loader, stopped with the snapshot's memory in place, the
+ * registers and take over the screen and getrand state. */
+static void resume(pid_t child)
+{
+    struct snapheader h;
+    reg_t regs;
+    long r;
+
+    snapheader(resumefile, &h);
+
+    r = ptrace(PTRACE_GETREGS, child, NULL, &regs);
+    SYSERR(r, "PTRACE_GETREGS");
+
+    /* The thread pointer and segments stay the loader's, and no syscall
+     * is to be restarted. */
+    h.regs.fs_base = regs.fs_base;
+    h.regs.gs_base = regs.gs_base;
+    h.regs.cs = regs.cs;
+    h.regs.ss = regs.ss;
+    h.regs.ds = regs.ds;
+    h.regs.es = regs.es;
+    h.regs.fs = regs.fs;
+    h.regs.gs = regs.gs;
+    h.regs.orig_rax = -1;
+
+    r = ptrace(PTRACE_SETREGS, child, NULL, &h.regs);
+    SYSERR(r, "PTRACE_SETREGS");
+    r = ptrace(PTRACE_SETFPREGS, child, NULL, &h.fpregs);
+    SYSERR(r, "PTRACE_SETFPREGS");
+
+    scrcopy(screen, h.cells);
+    scrcursor(screen, h.curx, h.cury);
+    pool = h.pool;
+}
+
+static void execsession(char *prog[], int n, int fbfd)
+{
+    execloader(prog, n, BACKEND_PTRACE, -1, -1, fbfd, -1);
+}
+
+static void usage()
+{
+    EMUERR("Usage: emu [-b ptrace|seccomp|rewrite] [-d ansi|ncurses|headless] "
+           "[-o recording] [-s seed] [-j jobfile] [-m sessionfile] "
+           "[-t statsfile] [-e eventfile] [-r refreshhz] [-p profile] "
+           "[-P samplehz] [-L] [-H] [-E] [-C snapshot] [-N n] "
+           "[-R snapshot] "
+           "<prog> <arg1> <arg2> ...");
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+    pid_t child;
+    int opt;
+    int backend = BACKEND_PTRACE;
+    int chanfd = -1;
+    int fbfd = -1;
+    int evfd = -1;
+    int sock[2] = { -1, -1 };
+    char *jobfile = NULL;
+    char *sessfile = NULL;
+    char *record = NULL;
+    char *evfile = NULL;
+    int useloader = 0;
+
+    while ((opt = getopt(argc, argv, "+b:C:d:e:Ej:HLm:N:o:p:P:r:R:s:t:")) != -1)
     {
-        r = ptrace(PTRACE_SETOPTIONS, child, NULL,
-                   PTRACE_O_EXITKILL | PTRACE_O_TRACESYSGOOD);
-        SYSERR(r, "PTRACE_SETOPTIONS");
+        switch (opt) {
+        case 'b':
+            if (!strcmp(optarg, "ptrace"))
+                backend = BACKEND_PTRACE;
+            else if (!strcmp(optarg, "seccomp"))
+                backend = BACKEND_SECCOMP;
+            else if (!strcmp(optarg, "rewrite"))
+                backend = BACKEND_REWRITE;
+            else
+                usage();
+            backendname = optarg;
+            break;
+        case 'C':
+            snapfile = optarg;
+            break;
+        case 'd':
+            if (!strcmp(optarg, ansidisplay.name))
+                display = &ansidisplay;
+            else if (!strcmp(optarg, cursesdisplay.name))
+                display = &cursesdisplay;
+            else if (!strcmp(optarg, headlessdisplay.name))
+                display = &headlessdisplay;
+            else
+                usage();
+            break;
+        case 'e':
+            evfile = optarg;
+            break;
+        case 'E':
+            mapflags |= ELF_POPULATE;
+            break;
+        case 'j':
+            jobfile = optarg;
+            break;
+        case 'H':
+            mapflags |= ELF_HUGE;
+            break;
+        case 'L':
+            useloader = 1;
+            break;
+        case 'm':
+            sessfile = optarg;
+            break;
+        case 'N':
+            snapat = strtoull(optarg, NULL, 0);
+            break;
+        case 'o':
+            record = optarg;
+            break;
+        case 'p':
+            profilefile = optarg;
+            break;
+        case 'P':
+            profilehz = atol(optarg);
+            if (profilehz < 1 || profilehz > 100000)
+                usage();
+            break;
+        case 'r':
+            refreshhz = atol(optarg);
+            if (refreshhz < 0 || refreshhz > 1000)
+                usage();
+            break;
+        case 'R':
+            resumefile = optarg;
+            break;
+        case 's':
+            seeded = 1;
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            statsfile = optarg;
+            break;
+        default:
+            usage();
+            break;
+        }
     }
-    else EMUERR("Impossible...");
 
-    initncurses();
+    if (sessfile) {
+        /* Every session brings its own program. */
+        if (backend != BACKEND_PTRACE || jobfile || profilefile || evfile
+                || snapfile || resumefile)
+            EMUERR("Sessions (-m) need the ptrace backend, no jobs, "
+                   "no profiling, no event log and no snapshots");
+        supervise(sessfile, execsession, seeded ? &seed : NULL);
+    }
 
-    /* Start the alien program emulation. */
-    for (;;)
-    {
-        r = ptrace(PTRACE_SYSEMU, child, NULL, NULL);
-        SYSERR(r, "PTRACE_SYSEMU");
+    if (optind == argc)
+        usage();
+    progpath = argv[optind];
 
-        r = waitpid(child, &status, __WALL);
-        SYSERR(r, "waitpid");
+    if ((snapfile || resumefile) && (backend != BACKEND_PTRACE || jobfile))
+        EMUERR("Snapshots (-C, -R) need the ptrace backend and no jobs");
 
-        if (WIFSIGNALED(status))
-            EMUERR("The alien program was terminated by a signal");
+    if (profilefile) {
+        if (backend != BACKEND_PTRACE)
+            EMUERR("Profiling (-p) needs the ptrace backend");
+        profinit(argv[optind]);
+    }
 
-        if (WIFSTOPPED(status)) {
-            int signum;
+    if (jobfile) {
+        if (backend != BACKEND_PTRACE)
+            EMUERR("Jobs (-j) need the ptrace backend");
 
-            signum = WSTOPSIG(status);
+        r = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sock);
+        SYSERR(r, "socketpair");
+    }
 
-            if (signum != (SIGTRAP | 0x80))
-                EMUERR("An unexpected signal delivered to the alien program");
+    if (backend != BACKEND_PTRACE) {
+        chan = newchannel(&chanfd);
+        screen = &chan->screen;
+        chan->seeded = seeded;
+        chan->seed = seed;
+        chan->statson = statsfile != NULL;
+    }
+    else if (seeded)
+        randseed(&pool, seed);
+    scrinit(screen);
 
-            handlesyscall(child);
-        }
+    if (evfile)
+        evring = newevlog(&evfd);
+
+    /* Unused unless the program turns out to have a PT_FRAMEBUF. */
+    fb = newframebuf(&fbfd);
+
+    /* Only the ptrace backend can do without the loader, if the kernel
+     * lets it. Huge pages need madvise and a resumed stack an mmap of
+     * its own, only the loader can do those. */
+    child = -1;
+    if (backend == BACKEND_PTRACE && !jobfile && !useloader
+            && !(mapflags & ELF_HUGE) && !resumefile)
+        child = remotestart(argv + optind, argc - optind, fbfd, mapflags);
+    if (child == -1)
+        child = startloader(argv + optind, argc - optind, backend, chanfd,
+                            sock[1], fbfd, chan ? evfd : -1);
+
+    if (sock[1] != -1) {
+        r = close(sock[1]);
+        SYSERR(r, "close");
+    }
+    r = close(fbfd);
+    SYSERR(r, "close");
+    if (evfd != -1) {
+        r = close(evfd);
+        SYSERR(r, "close");
+    }
+
+    /* Registered after the fork so a failing exec does not dump too. */
+    if (statsfile) {
+        r = atexit(dumpstats);
+        if (r) EMUERR("atexit");
+    }
+    if (profilefile) {
+        r = atexit(dumpprofile);
+        if (r) EMUERR("atexit");
     }
+    if (evring)
+        evlogstart(evring, evfile);
+
+    if (resumefile)
+        resume(child);
+
+    if (!fb->mapped) {
+        r = munmap(fb, sizeof *fb);
+        SYSERR(r, "munmap");
+        fb = NULL;
+    }
+
+    display->init(record);
+    r = clock_gettime(CLOCK_MONOTONIC, &lastpresent);
+    SYSERR(r, "clock_gettime");
+
+    /* Start the alien program emulation. */
+    if (jobfile) {
+        r = kill(child, SIGCONT);
+        SYSERR(r, "kill");
+        forkserver(child, sock[0], jobfile);
+    }
+
+    if (backend != BACKEND_PTRACE)
+        emulatetrapped(child);
+
+    r = ptrace(PTRACE_SETOPTIONS, child, NULL,
+               PTRACE_O_EXITKILL | PTRACE_O_TRACESYSGOOD);
+    SYSERR(r, "PTRACE_SETOPTIONS");
+
+    initwait();
+    renderstart(screen, display);
+
+    exit(emulateptrace(child));
 }
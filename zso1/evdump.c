@@ -0,0 +1,97 @@
+/* Prints an event file written by emu -e, one syscall per line:
+ *     time pid syscall(args) = result [duration]
+ * with the time in seconds since the first record.
+ * Usage: evdump <eventfile> */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "evlog.h"
+
+static void die(const char *msg)
+{
+    fprintf(stderr, "evdump: %s\n", msg);
+    exit(1);
+}
+
+static void show(const struct evrecord *e, uint64_t start)
+{
+    const uint64_t *a = e->args;
+
+    if (e->nr == EV_DROPPED) {
+        printf("%lu records lost, the ring was full\n", (unsigned long) a[0]);
+        return;
+    }
+
+    printf("%12.6f %6d ", (e->ns - start) / 1e9, e->pid);
+
+    switch (e->nr) {
+    case 0:
+        printf("end(%d)", (int) a[0]);
+        break;
+    case 1:
+        printf("getrand() = 0x%08x", (uint32_t) e->result);
+        break;
+    case 2:
+        printf("getkey() = 0x%02x", (int) e->result);
+        break;
+    case 3:
+        printf("print(%d, %d, 0x%lx, %d)", (int) a[0], (int) a[1],
+               (unsigned long) a[2], (int) a[3]);
+        break;
+    case 4:
+        printf("setcursor(%d, %d)", (int) a[0], (int) a[1]);
+        break;
+    case 5:
+        printf("printspans(0x%lx, %d)", (unsigned long) a[0], (int) a[1]);
+        break;
+    case 6:
+        printf("present()");
+        break;
+    default:
+        printf("syscall%d(0x%lx, 0x%lx, 0x%lx, 0x%lx)", e->nr,
+               (unsigned long) a[0], (unsigned long) a[1],
+               (unsigned long) a[2], (unsigned long) a[3]);
+        break;
+    }
+
+    printf(" [%lu ns]\n", (unsigned long) e->durns);
+}
+
+int main(int argc, char *argv[])
+{
+    struct evheader h;
+    struct evrecord e;
+    uint64_t start = 0;
+    int first = 1;
+    FILE *f;
+
+    if (argc != 2)
+        die("usage: evdump <eventfile>");
+
+    f = fopen(argv[1], "r");
+    if (!f) {
+        perror(argv[1]);
+        exit(1);
+    }
+
+    if (fread(&h, sizeof h, 1, f) != 1
+            || memcmp(h.magic, EVLOG_MAGIC, sizeof h.magic))
+        die("not an event file");
+    if (h.recsize != sizeof e)
+        die("unknown record size");
+
+    while (fread(&e, sizeof e, 1, f) == 1)
+    {
+        if (first && e.nr != EV_DROPPED) {
+            start = e.ns;
+            first = 0;
+        }
+        show(&e, start);
+    }
+
+    fclose(f);
+    return 0;
+}
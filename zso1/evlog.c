@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emuerr.h"
+#include "evlog.h"
+
+static struct evring *ring;
+static int outfd = -1;
+/* The loader maps the ring into the alien process, which can write head
+ * and tail as it likes. drain trusts only its own tail, and records that
+ * head claims beyond the ring are counted here as dropped. */
+static uint64_t tail, overrun;
+/* Drops already reported with an EV_DROPPED record. */
+static uint64_t reported;
+/* The writer thread and exit both drain. */
+static pthread_mutex_t draining = PTHREAD_MUTEX_INITIALIZER;
+
+
+struct evring *newevlog(int *fd)
+{
+    struct evring *r;
+    int ret;
+
+    /* Only the seccomp loader gets it, see execloader. */
+    *fd = memfd_create("alienos-evlog", MFD_CLOEXEC);
+    SYSERR(*fd, "memfd_create");
+
+    ret = ftruncate(*fd, sizeof *r);
+    SYSERR(ret, "ftruncate");
+
+    r = mmap(NULL, sizeof *r, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    SYS2ERR(r, "mmap evlog");
+
+    return r;
+}
+
+static void writeall(const void *buf, size_t len)
+{
+    ssize_t r;
+
+    while (len > 0)
+    {
+        r = write(outfd, buf, len);
+        if (r == -1 && errno == EINTR)
+            continue;
+        SYSERR(r, "write evlog");
+
+        buf = (const char *) buf + r;
+        len -= r;
+    }
+}
+
+/* Write out every record in the ring, at most two writes. */
+static void drain()
+{
+    struct evrecord lost;
+    uint64_t head, dropped;
+    size_t first;
+
+    pthread_mutex_lock(&draining);
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (head < tail) {
+        /* Never done by evput, there is nothing to trust in the ring. */
+        LOGTOFILE("evlog: ring head %llu behind its tail %llu",
+                  (unsigned long long) head, (unsigned long long) tail);
+        tail = head;
+    }
+    else if (head - tail > EVLOG_SLOTS) {
+        overrun += head - tail - EVLOG_SLOTS;
+        tail = head - EVLOG_SLOTS;
+    }
+
+    if (head != tail) {
+        first = EVLOG_SLOTS - tail % EVLOG_SLOTS;
+        if (first > head - tail)
+            first = head - tail;
+
+        writeall(&ring->recs[tail % EVLOG_SLOTS], first * sizeof *ring->recs);
+        if (first < head - tail)
+            writeall(ring->recs, (head - tail - first) * sizeof *ring->recs);
+
+        tail = head;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED) + overrun;
+    if (dropped > reported) {
+        memset(&lost, 0, sizeof lost);
+        lost.nr = EV_DROPPED;
+        lost.args[0] = dropped - reported;
+        writeall(&lost, sizeof lost);
+        reported = dropped;
+    }
+
+    pthread_mutex_unlock(&draining);
+}
+
+static void *writer(void *arg)
+{
+    struct timespec ts;
+
+    for (;;)
+    {
+        ts.tv_sec = 0;
+        ts.tv_nsec = EVLOG_FLUSH_USEC * 1000L;
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+            ;
+
+        drain();
+    }
+
+    (void) arg;
+    return NULL;
+}
+
+void evlogstart(struct evring *r, const char *path)
+{
+    struct evheader h;
+    pthread_t thread;
+    sigset_t all, saved;
+    int ret;
+
+    ring = r;
+
+    outfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                 0644);
+    SYSERR(outfd, "open %s", path);
+
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, EVLOG_MAGIC, sizeof h.magic);
+    h.recsize = sizeof (struct evrecord);
+    writeall(&h, sizeof h);
+
+    ret = atexit(drain);
+    if (ret) EMUERR("atexit");
+
+    /* Signals stay with the emulation thread, which sigwaits for them. */
+    ret = sigfillset(&all);
+    SYSERR(ret, "sigfillset");
+    ret = pthread_sigmask(SIG_BLOCK, &all, &saved);
+    if (ret) EMUERR("pthread_sigmask: %s", strerror(ret));
+
+    ret = pthread_create(&thread, NULL, writer, NULL);
+    if (ret) EMUERR("pthread_create: %s", strerror(ret));
+    ret = pthread_detach(thread);
+    if (ret) EMUERR("pthread_detach: %s", strerror(ret));
+
+    ret = pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (ret) EMUERR("pthread_sigmask: %s", strerror(ret));
+}
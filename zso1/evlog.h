@@ -0,0 +1,70 @@
+#ifndef EVLOG_H
+#define EVLOG_H
+
+#include <stdint.h>
+
+/* Binary trace of every AlienOS syscall, emu -e. Whoever serves syscalls
+ * (emu with ptrace, the loader's SIGSYS handler with seccomp) appends
+ * records to a ring in a memfd without ever blocking or making a
+ * syscall; a thread in emu drains it to the event file. The file is an
+ * evheader and then nothing but evrecords, evdump prints it. */
+
+#define EVLOG_MAGIC "ALIENEV1"
+
+/* A power of two, 4 MiB of records. Drained every EVLOG_FLUSH_USEC,
+ * that keeps up with 6.5 million syscalls a second. */
+#define EVLOG_SLOTS 65536
+#define EVLOG_FLUSH_USEC 10000
+
+/* nr of a record standing for args[0] records the ring had no room for. */
+#define EV_DROPPED -1
+
+struct evheader {
+    char magic[8];
+    uint32_t recsize;
+    uint32_t reserved;
+};
+
+struct evrecord {
+    /* CLOCK_MONOTONIC at the syscall, and how long serving it took. */
+    uint64_t ns;
+    uint64_t durns;
+    int32_t pid;
+    int32_t nr;
+    /* rdi, rsi, rdx, r10. */
+    uint64_t args[4];
+    /* rax as returned, 0 for syscalls without a result. */
+    int64_t result;
+};
+
+/* Single producer, single consumer, shared between processes. */
+struct evring {
+    uint64_t head;
+    uint64_t dropped;
+    uint64_t tail __attribute__((aligned(64)));
+    struct evrecord recs[EVLOG_SLOTS] __attribute__((aligned(64)));
+};
+
+static inline void evput(struct evring *r, const struct evrecord *rec)
+{
+    uint64_t head, tail;
+
+    head = r->head;
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= EVLOG_SLOTS) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    r->recs[head % EVLOG_SLOTS] = *rec;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Create the ring, its memfd (close-on-exec) goes to fd for the loader. */
+struct evring *newevlog(int *fd);
+
+/* Write the ring to path from now on, every EVLOG_FLUSH_USEC and at
+ * exit. */
+void evlogstart(struct evring *r, const char *path);
+
+#endif // EVLOG_H
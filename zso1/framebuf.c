@@ -0,0 +1,29 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emuerr.h"
+#include "framebuf.h"
+
+struct framebuf *newframebuf(int *fd)
+{
+    struct framebuf *f;
+    int r;
+
+    *fd = memfd_create("alienos-framebuf", 0);
+    SYSERR(*fd, "memfd_create");
+
+    r = ftruncate(*fd, sizeof *f);
+    SYSERR(r, "ftruncate");
+
+    f = mmap(NULL, sizeof *f, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    SYS2ERR(f, "mmap framebuf");
+
+    memset(f->cells, 0xFF, sizeof f->cells);
+
+    return f;
+}
@@ -0,0 +1,24 @@
+#ifndef FRAMEBUF_H
+#define FRAMEBUF_H
+
+#include <stdint.h>
+
+#include "screen.h"
+
+#define FRAMEBUF_PAGE 4096
+
+/* memfd shared by the emulator and the loader. Only the first page, the
+ * cells, is mapped into an alien program with a PT_FRAMEBUF segment. */
+struct framebuf {
+    /* As in print, CELL_NONE where the program has not drawn. */
+    uint16_t cells[MAX_Y][MAX_X];
+
+    /* Set by the loader once the cells are mapped into the program. */
+    int mapped __attribute__((aligned(FRAMEBUF_PAGE)));
+};
+
+/* Create a framebuffer, all CELL_NONE, and its memfd (inherited across
+ * exec, for the loader's -F) in fd. */
+struct framebuf *newframebuf(int *fd);
+
+#endif // FRAMEBUF_H
@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emuerr.h"
+#include "guestmem.h"
+
+#define LONG_SIZE (sizeof (long))
+
+/* Cleared once the kernel tells us process_vm_readv is not available. */
+static int usevmreadv = 1;
+
+static size_t vmread(pid_t child, void *buf, uint64_t addr, size_t len)
+{
+    struct iovec local, remote;
+    ssize_t r;
+
+    if (!usevmreadv)
+        return 0;
+
+    local.iov_base = buf;
+    local.iov_len = len;
+    remote.iov_base = (void *) addr;
+    remote.iov_len = len;
+
+    r = process_vm_readv(child, &local, 1, &remote, 1, 0);
+    if (r == -1) {
+        if (errno == ENOSYS || errno == EPERM)
+            usevmreadv = 0;
+        return 0;
+    }
+
+    return r;
+}
+
+static int peekread(pid_t child, void *buf, uint64_t addr, size_t len)
+{
+    uint64_t start;
+    size_t padding;
+    size_t chunk;
+    long word;
+
+    /* Make sure reads are naturally aligned with long type. */
+    padding = addr % LONG_SIZE;
+    start = addr - padding;
+
+    while (len > 0)
+    {
+        errno = 0;
+        word = ptrace(PTRACE_PEEKDATA, child, (void *) start, NULL);
+        if (errno)
+            return -1;
+
+        chunk = LONG_SIZE - padding;
+        if (chunk > len)
+            chunk = len;
+
+        memcpy(buf, (char *) &word + padding, chunk);
+
+        buf = (char *) buf + chunk;
+        len -= chunk;
+        start += LONG_SIZE;
+        padding = 0;
+    }
+
+    return 0;
+}
+
+int tryreadmem(pid_t child, void *buf, uint64_t addr, size_t len)
+{
+    size_t done;
+
+    done = vmread(child, buf, addr, len);
+
+    /* A short read means the tail is not readable the cheap way
+     * (e.g. PROT_NONE pages), ptrace may still get to it. */
+    if (done < len)
+        return peekread(child, (char *) buf + done, addr + done, len - done);
+
+    return 0;
+}
+
+void readmem(pid_t child, void *buf, uint64_t addr, size_t len)
+{
+    if (tryreadmem(child, buf, addr, len))
+        SYSERR(-1, "PTRACE_PEEKDATA");
+}
+
+int tryreadmemv(pid_t child, const struct iovec *local,
+                const struct iovec *remote, int n)
+{
+    size_t len;
+    ssize_t r;
+    int i, m;
+
+    for (; n > 0; local += m, remote += m, n -= m)
+    {
+        m = n < IOV_MAX ? n : IOV_MAX;
+
+        len = 0;
+        for (i = 0; i < m; ++i)
+            len += remote[i].iov_len;
+
+        if (usevmreadv) {
+            r = process_vm_readv(child, local, m, remote, m, 0);
+            if (r == (ssize_t) len)
+                continue;
+            if (r == -1 && (errno == ENOSYS || errno == EPERM))
+                usevmreadv = 0;
+        }
+
+        /* Let tryreadmem sort out which range is the trouble. */
+        for (i = 0; i < m; ++i)
+            if (tryreadmem(child, local[i].iov_base,
+                           (uint64_t) remote[i].iov_base, remote[i].iov_len))
+                return -1;
+    }
+
+    return 0;
+}
+
+void readmemv(pid_t child, const struct iovec *local,
+              const struct iovec *remote, int n)
+{
+    if (tryreadmemv(child, local, remote, n))
+        SYSERR(-1, "PTRACE_PEEKDATA");
+}
+
+static int pokewrite(pid_t child, uint64_t addr, const void *buf, size_t len)
+{
+    uint64_t start;
+    size_t padding;
+    size_t chunk;
+    long word;
+
+    padding = addr % LONG_SIZE;
+    start = addr - padding;
+
+    while (len > 0)
+    {
+        chunk = LONG_SIZE - padding;
+        if (chunk > len)
+            chunk = len;
+
+        /* Keep the bytes around a partial word. */
+        if (chunk != LONG_SIZE) {
+            errno = 0;
+            word = ptrace(PTRACE_PEEKDATA, child, (void *) start, NULL);
+            if (errno)
+                return -1;
+        }
+        memcpy((char *) &word + padding, buf, chunk);
+
+        if (ptrace(PTRACE_POKEDATA, child, (void *) start, (void *) word))
+            return -1;
+
+        buf = (const char *) buf + chunk;
+        len -= chunk;
+        start += LONG_SIZE;
+        padding = 0;
+    }
+
+    return 0;
+}
+
+void writemem(pid_t child, uint64_t addr, const void *buf, size_t len)
+{
+    struct iovec local, remote;
+    ssize_t r = 0;
+
+    if (usevmreadv) {
+        local.iov_base = (void *) buf;
+        local.iov_len = len;
+        remote.iov_base = (void *) addr;
+        remote.iov_len = len;
+
+        r = process_vm_writev(child, &local, 1, &remote, 1, 0);
+        if (r == -1)
+            r = 0;
+    }
+
+    if ((size_t) r < len && pokewrite(child, addr + r,
+                                      (const char *) buf + r, len - r))
+        SYSERR(-1, "PTRACE_POKEDATA");
+}
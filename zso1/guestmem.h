@@ -0,0 +1,28 @@
+#ifndef GUESTMEM_H
+#define GUESTMEM_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Copy len bytes starting at addr in the child's address space into buf.
+ * The whole range is read at once with process_vm_readv; PTRACE_PEEKDATA
+ * is only used for whatever the fast path could not deliver. */
+void readmem(pid_t child, void *buf, uint64_t addr, size_t len);
+
+/* Same as readmem, but returns -1 with errno set instead of exiting. */
+int tryreadmem(pid_t child, void *buf, uint64_t addr, size_t len);
+
+/* Gather n ranges at once, remote[i] in the child into local[i]. */
+void readmemv(pid_t child, const struct iovec *local,
+              const struct iovec *remote, int n);
+
+int tryreadmemv(pid_t child, const struct iovec *local,
+                const struct iovec *remote, int n);
+
+/* Copy len bytes from buf to addr in the child with process_vm_writev,
+ * PTRACE_POKEDATA for whatever that cannot reach (e.g. read-only pages). */
+void writemem(pid_t child, uint64_t addr, const void *buf, size_t len);
+
+#endif // GUESTMEM_H
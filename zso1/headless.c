@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "alienos.h"
+#include "ansi.h"
+#include "display.h"
+#include "emuerr.h"
+#include "screen.h"
+
+/* Frames are recorded as asciicast v2: a JSON header line, then one
+ * [seconds, "o", "escape sequences"] event per present. */
+
+static FILE *rec;
+static struct timespec start;
+
+/* The terminal a player of the recording shows. */
+static struct ansi term;
+
+
+/* Escape sequences go into a JSON string, where ESC must be \u001b. */
+static void jsonput(const char *s, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i)
+    {
+        if ((unsigned char) s[i] < 0x20)
+            fprintf(rec, "\\u%04x", s[i]);
+        else if (s[i] == '"' || s[i] == '\\')
+            fprintf(rec, "\\%c", s[i]);
+        else
+            fputc(s[i], rec);
+    }
+}
+
+static void exitheadless()
+{
+    if (rec) {
+        fclose(rec);
+        rec = NULL;
+    }
+}
+
+static void initheadless(const char *record)
+{
+    int r;
+
+    r = clock_gettime(CLOCK_MONOTONIC, &start);
+    SYSERR(r, "clock_gettime");
+
+    if (!record)
+        return;
+
+    atexit(exitheadless);
+
+    rec = fopen(record, "w");
+    if (!rec) SYSERR(-1, "fopen %s", record);
+
+    fprintf(rec, "{\"version\": 2, \"width\": %d, \"height\": %d, "
+                 "\"timestamp\": %ld}\n", MAX_X, MAX_Y, (long) time(NULL));
+
+    ansiclear(&term);
+}
+
+static void clearheadless()
+{
+    if (!rec)
+        return;
+
+    ansiclear(&term);
+}
+
+static void putcells(int x, int y, const uint16_t *cells, int n)
+{
+    if (rec)
+        ansiputcells(&term, x, y, cells, n);
+}
+
+static void flush(int curx, int cury)
+{
+    struct timespec now;
+    int r;
+
+    if (!rec)
+        return;
+
+    ansicursor(&term, curx, cury);
+
+    r = clock_gettime(CLOCK_MONOTONIC, &now);
+    SYSERR(r, "clock_gettime");
+
+    fprintf(rec, "[%.6f, \"o\", \"",
+            (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9);
+    jsonput(term.buf, term.len);
+    fputs("\"]\n", rec);
+    term.len = 0;
+}
+
+/* Keys come from stdin as a terminal would send them. */
+static int getkey() { return ansikey(stdin); }
+
+const struct display headlessdisplay = {
+    .name = "headless",
+    .init = initheadless,
+    .fini = exitheadless,
+    .clear = clearheadless,
+    .putcells = putcells,
+    .flush = flush,
+    .getkey = getkey,
+};
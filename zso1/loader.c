@@ -4,106 +4,276 @@
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 
 #include "alienos.h"
+#include "elfload.h"
 #include "emuerr.h"
+#include "rewrite.h"
+#include "snapshot.h"
+#include "trap.h"
 
-#define PAGE_SIZE 4096
+/* Most arguments a fork server job may pass. */
+#define MAX_JOB_ARGS 1024
 
+/* Rewrite syscall sites to call the in-process dispatcher directly. */
+static int rewriting;
 
-static void saferead(int fd, void *buf, size_t count, off_t offset)
-{
-    if (pread(fd, buf, count, offset) < count)
-        EMUERR("saferead");
-}
+/* Socket to the emulator when running as a fork server. */
+static int serverfd = -1;
+
+/* Screen memory shared with the emulator, for PT_FRAMEBUF. */
+static int fbfd = -1;
+
+/* The alien program, kept for the fork server's per-job params. */
+static struct alienelf elf;
+
+/* ELF_HUGE and ELF_POPULATE, from -H and -E. */
+static int mapflags;
 
-static int convflags(uint32_t flags)
+/* A snapshot to resume instead of starting afresh (ptrace backend). */
+static const char *snapfile;
+
+
+/* The pages of phdr's segment, [*from, *to), minus the first and the
+ * last when another PT_LOAD segment has a part of them too. */
+static void ownpages(const Elf64_Phdr *phdr, uint64_t *from, uint64_t *to)
 {
-    int prot = 0;
-    if (flags & PF_X) prot |= PROT_EXEC;
-    if (flags & PF_W) prot |= PROT_WRITE;
-    if (flags & PF_R) prot |= PROT_READ;
+    const Elf64_Phdr *other;
+    uint64_t start, end, ostart, oend;
+    int i;
+
+    start = phdr->p_vaddr & ~(uint64_t) (PAGE_SIZE - 1);
+    end = (phdr->p_vaddr + phdr->p_memsz + PAGE_SIZE - 1)
+          & ~(uint64_t) (PAGE_SIZE - 1);
+    *from = start;
+    *to = end;
+
+    for (i = 0; i < elf.ehdr.e_phnum; ++i)
+    {
+        other = &elf.phdrs[i];
+        if (other == phdr || other->p_type != PT_LOAD)
+            continue;
 
-    return prot;
+        ostart = other->p_vaddr & ~(uint64_t) (PAGE_SIZE - 1);
+        oend = (other->p_vaddr + other->p_memsz + PAGE_SIZE - 1)
+               & ~(uint64_t) (PAGE_SIZE - 1);
+        if (ostart < start + PAGE_SIZE && oend > start)
+            *from = start + PAGE_SIZE;
+        if (ostart < end && oend > end - PAGE_SIZE)
+            *to = end - PAGE_SIZE;
+    }
 }
 
-Elf64_Addr loadelf(int argc, char *argv[])
+static void rewritesegment(const Elf64_Phdr *phdr)
 {
-    Elf64_Ehdr ehdr;
-    Elf64_Phdr phdr;
-    int fd;
-    int i, j;
-    off_t offset;
-    void *addr;
     int padding;
     void *pageaddr;
     size_t memsz;
+    uint64_t from, to;
+    int r;
+
+    padding = phdr->p_vaddr % PAGE_SIZE;
+    pageaddr = (void *) (phdr->p_vaddr - padding);
+    memsz = phdr->p_memsz + padding;
+
+    r = mprotect(pageaddr, memsz, PROT_READ | PROT_WRITE);
+    SYSERR(r, "mprotect");
+
+    ownpages(phdr, &from, &to);
+    rewrite(phdr->p_vaddr, phdr->p_filesz, elfprot(phdr->p_flags), from, to);
+
+    r = mprotect(pageaddr, memsz, elfprot(phdr->p_flags));
+    SYSERR(r, "mprotect");
+}
+
+Elf64_Addr loadelf(int argc, char *argv[])
+{
+    const Elf64_Phdr *phdr;
+    int32_t *params;
+    int i;
     int r;
 
     if (argc == 1) EMUERR("No program to emulate.");
 
-    fd = open(argv[1], O_RDONLY);
-    SYSERR(fd, "open");
+    elfopen(&elf, argv[1]);
+    elfmap(&elf, &localmapper, fbfd, mapflags);
+
+    /* Trampolines go next to the code, so wait for every segment. */
+    for (i = 0; rewriting && i < elf.ehdr.e_phnum; ++i)
+    {
+        phdr = &elf.phdrs[i];
+
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X))
+            rewritesegment(phdr);
+    }
+
+    elfclose(&elf);
+
+    if (fbfd != -1) {
+        r = close(fbfd);
+        SYSERR(r, "close framebuffer");
+    }
+
+    /* A fork server fills them in per job, a snapshot has its own. */
+    if (snapfile)
+        snapmap(snapfile, elf.ehdr.e_entry);
+    else if (serverfd == -1) {
+        params = malloc((argc - 2 + 1) * sizeof *params);
+        if (!params) EMUERR("malloc");
 
-    saferead(fd, &ehdr, (sizeof ehdr), 0);
+        for (i = 0; i < argc - 2; ++i)
+            params[i] = atoi(argv[i + 2]);
+        elfparams(&elf, &localmapper, argc - 2, params);
 
-    for (i = 0; i < ehdr.e_phnum; ++i)
+        free(params);
+    }
+
+    return elf.ehdr.e_entry;
+}
+
+/* Read exactly count bytes, 0 on end of file. */
+static int saferecv(int fd, void *buf, size_t count)
+{
+    ssize_t r;
+    size_t done = 0;
+
+    while (done < count)
     {
-        offset = ehdr.e_phoff + i * (sizeof phdr);
-        saferead(fd, &phdr, (sizeof phdr), offset);
-        
-        /* mmap & mprotect address must be aligned to a page boundary */
-        padding = phdr.p_vaddr % PAGE_SIZE;
-        pageaddr = (void *) (phdr.p_vaddr - padding);
-        memsz = phdr.p_memsz + padding;
-
-        addr = mmap(pageaddr, memsz, PROT_WRITE,
-                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
-                    -1, 0);
-        SYS2ERR(addr, "mmap");
-
-        switch (phdr.p_type) {
-        case PT_LOAD:
-            saferead(fd, (void *) phdr.p_vaddr, phdr.p_filesz, phdr.p_offset);
-            break;
-        
-        case PT_PARAMS:
-            if (argc - 2 != phdr.p_memsz / 4)
-                EMUERR("Invalid argnum for the alien program");
-
-            for (j = 0; j < phdr.p_memsz / 4; ++j)
-                /* x86_64 is little endian and sizeof (int) == 4 */
-                *((int *) phdr.p_vaddr + j) = atoi(argv[j+2]);
-            break;
+        r = read(fd, (char *) buf + done, count - done);
+        SYSERR(r, "read");
+        if (r == 0)
+            return 0;
 
-        default:
-            EMUERR("Unexpected segment type");
-            break;
+        done += r;
+    }
+
+    return 1;
+}
+
+/* Fork server: for every job the emulator sends (an argument count and
+ * the arguments), fork a copy of the loaded program, fill in its params
+ * and stop it for the emulator to attach to. Only returns in a copy. */
+static void serve()
+{
+    int32_t n;
+    int32_t *params;
+    int32_t reply;
+    pid_t pid;
+
+    /* The emulator collects the copies' exit statuses as their tracer. */
+    signal(SIGCHLD, SIG_IGN);
+
+    params = malloc(MAX_JOB_ARGS * sizeof *params);
+    if (!params) EMUERR("malloc");
+
+    for (;;)
+    {
+        if (!saferecv(serverfd, &n, sizeof n))
+            exit(0);
+        if (n < 0 || n > MAX_JOB_ARGS)
+            EMUERR("serve: invalid argnum");
+        if (!saferecv(serverfd, params, n * sizeof *params))
+            EMUERR("serve: truncated job");
+
+        pid = fork();
+        if (pid == 0) {
+            close(serverfd);
+            signal(SIGCHLD, SIG_DFL);
+
+            elfparams(&elf, &localmapper, n, params);
+            free(params);
+
+            /* Wait for the emulator to PTRACE_SEIZE us. */
+            raise(SIGSTOP);
+            return;
         }
 
-        r = mprotect(pageaddr, memsz, convflags(phdr.p_flags));
-        SYSERR(r, "mprotect");
+        reply = pid;
+        if (write(serverfd, &reply, sizeof reply) != sizeof reply)
+            SYSERR(-1, "write");
     }
-
-    return ehdr.e_entry;
 }
 
 int main(int argc, char *argv[])
 {
     long r;
     Elf64_Addr addr;
+    int opt;
+    int chanfd = -1;
+    int evfd = -1;
 
-    addr = loadelf(argc, argv);
+    while ((opt = getopt(argc, argv, "+c:e:Ef:F:HrR:")) != -1)
+    {
+        switch (opt) {
+        case 'c':
+            chanfd = atoi(optarg);
+            break;
+        case 'e':
+            evfd = atoi(optarg);
+            break;
+        case 'E':
+            mapflags |= ELF_POPULATE;
+            break;
+        case 'f':
+            serverfd = atoi(optarg);
+            break;
+        case 'F':
+            fbfd = atoi(optarg);
+            break;
+        case 'H':
+            mapflags |= ELF_HUGE;
+            break;
+        case 'r':
+            rewriting = 1;
+            break;
+        case 'R':
+            snapfile = optarg;
+            break;
+        default:
+            EMUERR("Unknown loader option");
+            break;
+        }
+    }
+
+    if ((rewriting || evfd != -1) && chanfd == -1)
+        EMUERR("Rewriting and the event log need the seccomp backend");
+    if (snapfile && (chanfd != -1 || serverfd != -1))
+        EMUERR("Snapshots need the ptrace backend and no fork server");
 
-    r = ptrace(PTRACE_TRACEME, 0, NULL, NULL);
-    SYSERR(r, "PTRACE_TRACEME");
-    
-    /* Ensure the parent has a chance to start tracing. */
-    raise(SIGSTOP);
+    /* loadelf expects the program name in argv[1]. */
+    addr = loadelf(argc - optind + 1, argv + optind - 1);
+
+    if (serverfd != -1) {
+        if (chanfd != -1)
+            EMUERR("The fork server needs the ptrace backend");
+
+        /* Let the emulator set up the terminal first. */
+        raise(SIGSTOP);
+
+        serve();
+    }
+    else if (chanfd != -1) {
+        /* Seccomp backend: nobody traces us, syscalls trap in-process. */
+        inittrap(chanfd, evfd);
+
+        /* Let the emulator set up the terminal first. */
+        raise(SIGSTOP);
+
+        starttrap();
+    }
+    else {
+        r = ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        SYSERR(r, "PTRACE_TRACEME");
+
+        /* Ensure the parent has a chance to start tracing. */
+        raise(SIGSTOP);
+    }
 
-    goto *addr;
+    goto *(void *) addr;
 }
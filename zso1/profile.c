@@ -0,0 +1,388 @@
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/user.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emuerr.h"
+#include "guestmem.h"
+#include "profile.h"
+
+/* Most frames kept per sample, rip included. */
+#define MAX_DEPTH 64
+/* How much of the stack above rsp one sample reads. */
+#define STACK_BYTES 8192
+
+#define TABLE_INIT 1024
+
+struct segment {
+    uint64_t start, end;
+};
+
+struct symbol {
+    uint64_t addr, size;
+    const char *name;
+};
+
+/* One distinct stack, innermost frame first, and how often it was seen. */
+struct stack {
+    uint64_t hash;
+    uint64_t count;
+    int depth;
+    uint64_t *pcs;
+};
+
+static struct segment *segments;
+static int nsegments;
+
+static struct symbol *symbols;
+static int nsymbols;
+static char *strtab;
+
+/* Open addressing, never more than half full. */
+static struct stack *table;
+static size_t tablecap, nstacks;
+static uint64_t nsamples, nlost;
+
+
+static void saferead(int fd, void *buf, size_t count, off_t offset)
+{
+    if (pread(fd, buf, count, offset) != (ssize_t) count)
+        EMUERR("profile: short read");
+}
+
+static int bysymaddr(const void *a, const void *b)
+{
+    const struct symbol *x = a, *y = b;
+
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static int intext(uint64_t addr)
+{
+    int i;
+
+    for (i = 0; i < nsegments; ++i)
+        if (addr >= segments[i].start && addr < segments[i].end)
+            return 1;
+
+    return 0;
+}
+
+/* Keep the function and untyped (assembly label) symbols in the code. */
+static void readsymbols(int fd, const Elf64_Ehdr *ehdr)
+{
+    Elf64_Shdr *shdrs, *symtab, *strsec;
+    Elf64_Sym *syms;
+    size_t n, i;
+    int type;
+
+    if (!ehdr->e_shnum || ehdr->e_shentsize != sizeof *shdrs)
+        return;
+
+    shdrs = malloc(ehdr->e_shnum * sizeof *shdrs);
+    if (!shdrs) EMUERR("malloc");
+    saferead(fd, shdrs, ehdr->e_shnum * sizeof *shdrs, ehdr->e_shoff);
+
+    symtab = NULL;
+    for (i = 0; i < ehdr->e_shnum; ++i)
+        if (shdrs[i].sh_type == SHT_SYMTAB)
+            symtab = &shdrs[i];
+    if (!symtab || symtab->sh_link >= ehdr->e_shnum) {
+        free(shdrs);
+        return;
+    }
+    strsec = &shdrs[symtab->sh_link];
+
+    n = symtab->sh_size / sizeof *syms;
+    syms = malloc(symtab->sh_size);
+    strtab = malloc(strsec->sh_size + 1);
+    symbols = malloc(n * sizeof *symbols);
+    if (!syms || !strtab || !symbols) EMUERR("malloc");
+    saferead(fd, syms, symtab->sh_size, symtab->sh_offset);
+    saferead(fd, strtab, strsec->sh_size, strsec->sh_offset);
+    strtab[strsec->sh_size] = '\0';
+
+    for (i = 0; i < n; ++i)
+    {
+        type = ELF64_ST_TYPE(syms[i].st_info);
+        if (type != STT_FUNC && type != STT_NOTYPE)
+            continue;
+        if (!intext(syms[i].st_value) || syms[i].st_name >= strsec->sh_size
+                || !strtab[syms[i].st_name])
+            continue;
+
+        symbols[nsymbols].addr = syms[i].st_value;
+        symbols[nsymbols].size = syms[i].st_size;
+        symbols[nsymbols].name = strtab + syms[i].st_name;
+        ++nsymbols;
+    }
+    qsort(symbols, nsymbols, sizeof *symbols, bysymaddr);
+
+    free(syms);
+    free(shdrs);
+}
+
+void profinit(const char *prog)
+{
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr *phdrs;
+    int fd;
+    int i;
+    int r;
+
+    fd = open(prog, O_RDONLY);
+    SYSERR(fd, "open %s", prog);
+
+    saferead(fd, &ehdr, sizeof ehdr, 0);
+    if (ehdr.e_phentsize != sizeof *phdrs)
+        EMUERR("profile: unexpected program header size");
+
+    phdrs = malloc(ehdr.e_phnum * sizeof *phdrs);
+    segments = malloc(ehdr.e_phnum * sizeof *segments);
+    if (!phdrs || !segments) EMUERR("malloc");
+    saferead(fd, phdrs, ehdr.e_phnum * sizeof *phdrs, ehdr.e_phoff);
+
+    for (i = 0; i < ehdr.e_phnum; ++i)
+    {
+        if (phdrs[i].p_type != PT_LOAD || !(phdrs[i].p_flags & PF_X))
+            continue;
+
+        segments[nsegments].start = phdrs[i].p_vaddr;
+        segments[nsegments].end = phdrs[i].p_vaddr + phdrs[i].p_memsz;
+        ++nsegments;
+    }
+
+    readsymbols(fd, &ehdr);
+
+    free(phdrs);
+    r = close(fd);
+    SYSERR(r, "close");
+}
+
+/* FNV-1a over the addresses. */
+static uint64_t hashpcs(const uint64_t *pcs, int depth)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int i, b;
+
+    for (i = 0; i < depth; ++i)
+        for (b = 0; b < 64; b += 8)
+        {
+            h ^= pcs[i] >> b & 0xff;
+            h *= 0x100000001b3ULL;
+        }
+
+    return h;
+}
+
+static struct stack *slot(struct stack *t, size_t cap, uint64_t hash,
+                          const uint64_t *pcs, int depth)
+{
+    struct stack *s;
+    size_t i;
+
+    for (i = hash & (cap - 1); ; i = (i + 1) & (cap - 1))
+    {
+        s = &t[i];
+        if (!s->pcs)
+            return s;
+        if (s->hash == hash && s->depth == depth
+                && !memcmp(s->pcs, pcs, depth * sizeof *pcs))
+            return s;
+    }
+}
+
+static void grow()
+{
+    struct stack *old = table;
+    size_t oldcap = tablecap, i;
+
+    tablecap = tablecap ? 2 * tablecap : TABLE_INIT;
+    table = calloc(tablecap, sizeof *table);
+    if (!table) EMUERR("calloc");
+
+    for (i = 0; i < oldcap; ++i)
+        if (old[i].pcs)
+            *slot(table, tablecap, old[i].hash, old[i].pcs, old[i].depth)
+                = old[i];
+
+    free(old);
+}
+
+static void record(const uint64_t *pcs, int depth)
+{
+    struct stack *s;
+    uint64_t hash;
+
+    if (2 * (nstacks + 1) > tablecap)
+        grow();
+
+    hash = hashpcs(pcs, depth);
+    s = slot(table, tablecap, hash, pcs, depth);
+    if (!s->pcs) {
+        s->hash = hash;
+        s->depth = depth;
+        s->pcs = malloc(depth * sizeof *pcs);
+        if (!s->pcs) EMUERR("malloc");
+        memcpy(s->pcs, pcs, depth * sizeof *pcs);
+        ++nstacks;
+    }
+    ++s->count;
+}
+
+void profsample(pid_t child)
+{
+    static uint64_t stack[STACK_BYTES / sizeof (uint64_t)];
+
+    struct user_regs_struct regs;
+    uint64_t pcs[MAX_DEPTH];
+    uint64_t fp, ret, next;
+    size_t got;
+    int depth = 0;
+    long r;
+
+    r = ptrace(PTRACE_GETREGS, child, NULL, &regs);
+    SYSERR(r, "PTRACE_GETREGS");
+
+    ++nsamples;
+    pcs[depth++] = regs.rip;
+
+    /* The stack may end sooner, its top page is there for sure. */
+    got = sizeof stack;
+    if (tryreadmem(child, stack, regs.rsp, got) == -1) {
+        got = PAGE_SIZE - regs.rsp % PAGE_SIZE;
+        if (tryreadmem(child, stack, regs.rsp, got) == -1)
+            got = 0;
+    }
+
+    /* Frames as pushed by `push %rbp; mov %rsp, %rbp`, going up only. */
+    fp = regs.rbp;
+    while (depth < MAX_DEPTH)
+    {
+        if (fp < regs.rsp || fp % 8 || fp - regs.rsp + 16 > got)
+            break;
+
+        memcpy(&next, (char *) stack + (fp - regs.rsp), sizeof next);
+        memcpy(&ret, (char *) stack + (fp - regs.rsp) + 8, sizeof ret);
+        if (!intext(ret))
+            break;
+
+        pcs[depth++] = ret;
+        if (next <= fp)
+            break;
+        fp = next;
+    }
+
+    if (!intext(regs.rip) && depth == 1)
+        ++nlost;
+
+    record(pcs, depth);
+}
+
+/* The name of the code at pc, into buf. */
+static void pcname(char *buf, size_t len, uint64_t pc)
+{
+    const struct symbol *sym = NULL;
+    int lo = 0, hi = nsymbols;
+
+    if (!intext(pc)) {
+        snprintf(buf, len, "[unknown]");
+        return;
+    }
+
+    /* The last symbol at or below pc. */
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (symbols[mid].addr <= pc) {
+            sym = &symbols[mid];
+            lo = mid + 1;
+        }
+        else
+            hi = mid;
+    }
+
+    if (sym && (!sym->size || pc < sym->addr + sym->size))
+        snprintf(buf, len, "%s", sym->name);
+    else
+        snprintf(buf, len, "0x%lx", (unsigned long) pc);
+}
+
+struct line {
+    char *text;
+    uint64_t count;
+};
+
+static int bytext(const void *a, const void *b)
+{
+    return strcmp(((const struct line *) a)->text,
+                  ((const struct line *) b)->text);
+}
+
+void profdump(const char *file)
+{
+    struct line *lines;
+    char name[256];
+    char *text;
+    size_t n = 0, len, i;
+    FILE *f;
+    int d;
+
+    lines = malloc((nstacks + 1) * sizeof *lines);
+    if (!lines) EMUERR("malloc");
+
+    /* Symbolize, then merge the stacks that end up with the same names. */
+    for (i = 0; i < tablecap; ++i)
+    {
+        if (!table[i].pcs)
+            continue;
+
+        text = malloc(table[i].depth * sizeof name);
+        if (!text) EMUERR("malloc");
+        text[0] = '\0';
+        len = 0;
+
+        for (d = table[i].depth - 1; d >= 0; --d)
+        {
+            /* Return addresses point past the call. */
+            pcname(name, sizeof name,
+                   table[i].pcs[d] - (d != 0 && intext(table[i].pcs[d] - 1)));
+            len += sprintf(text + len, "%s%s", len ? ";" : "", name);
+        }
+
+        lines[n].text = text;
+        lines[n].count = table[i].count;
+        ++n;
+    }
+    qsort(lines, n, sizeof *lines, bytext);
+
+    f = fopen(file, "w");
+    if (!f) SYSERR(-1, "fopen %s", file);
+
+    for (i = 0; i < n; ++i)
+    {
+        if (i + 1 < n && !strcmp(lines[i].text, lines[i + 1].text)) {
+            lines[i + 1].count += lines[i].count;
+            continue;
+        }
+        fprintf(f, "%s %lu\n", lines[i].text, (unsigned long) lines[i].count);
+    }
+
+    if (fclose(f) == EOF)
+        SYSERR(-1, "fclose %s", file);
+
+    for (i = 0; i < n; ++i)
+        free(lines[i].text);
+    free(lines);
+
+    LOGTOFILE("profile: %lu samples, %lu outside the program",
+              (unsigned long) nsamples, (unsigned long) nlost);
+}
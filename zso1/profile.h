@@ -0,0 +1,23 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <sys/types.h>
+
+/* Default samples per second, off the 60 Hz frame and refresh timers so
+ * the two do not run in lockstep. */
+#define PROFILE_HZ 997
+
+/* Read the executable PT_LOAD segments of prog, and its symbols if it has
+ * any, to attribute samples with. */
+void profinit(const char *prog);
+
+/* Record where the stopped child is: its rip, and the return addresses
+ * found by following the rbp chain through one read of its stack. */
+void profsample(pid_t child);
+
+/* Write every distinct stack seen as a line of folded stacks, outermost
+ * frame first: "main;draw;print 42". Frames are symbol names when the
+ * program has symbols, otherwise addresses. */
+void profdump(const char *file);
+
+#endif // PROFILE_H
@@ -0,0 +1,31 @@
+#ifndef PTRACEREMOTE_H
+#define PTRACEREMOTE_H
+
+#include <stdint.h>
+
+/* The part of include/linux/ptrace_remote.h from the zso3 kernel patch
+ * the emulator uses: mmap and mprotect done by a stopped tracee on the
+ * tracer's behalf. A file mapping names a file descriptor of the tracer.
+ * Other kernels answer these requests with EIO. */
+
+#define PTRACE_REMOTE_MMAP      50
+#define PTRACE_REMOTE_MPROTECT  53
+
+struct ptrace_remote_mmap {
+    uint64_t addr;
+    uint64_t length;
+    uint32_t prot;
+    uint32_t flags;
+    uint32_t fd;
+    uint32_t _pad;
+    uint64_t offset;
+};
+
+struct ptrace_remote_mprotect {
+    uint64_t addr;
+    uint64_t length;
+    uint32_t prot;
+    uint32_t _pad;
+};
+
+#endif // PTRACEREMOTE_H
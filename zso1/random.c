@@ -0,0 +1,85 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "random.h"
+
+#define ROTL(V, N) ((V) << (N) | (V) >> (32 - (N)))
+
+#define QR(A, B, C, D)                      \
+do {                                        \
+    A += B; D ^= A; D = ROTL(D, 16);        \
+    C += D; B ^= C; B = ROTL(B, 12);        \
+    A += B; D ^= A; D = ROTL(D, 8);         \
+    C += D; B ^= C; B = ROTL(B, 7);         \
+} while (0)
+
+static void chacha20(struct randpool *p)
+{
+    uint32_t in[16], x[16];
+    int i;
+
+    /* "expand 32-byte k" */
+    in[0] = 0x61707865;
+    in[1] = 0x3320646e;
+    in[2] = 0x79622d32;
+    in[3] = 0x6b206574;
+    memcpy(in + 4, p->key, sizeof p->key);
+    in[12] = (uint32_t) p->counter;
+    in[13] = (uint32_t) (p->counter >> 32);
+    in[14] = 0;
+    in[15] = 0;
+
+    memcpy(x, in, sizeof x);
+    for (i = 0; i < 10; ++i)
+    {
+        QR(x[0], x[4], x[8],  x[12]);
+        QR(x[1], x[5], x[9],  x[13]);
+        QR(x[2], x[6], x[10], x[14]);
+        QR(x[3], x[7], x[11], x[15]);
+        QR(x[0], x[5], x[10], x[15]);
+        QR(x[1], x[6], x[11], x[12]);
+        QR(x[2], x[7], x[8],  x[13]);
+        QR(x[3], x[4], x[9],  x[14]);
+    }
+
+    for (i = 0; i < 16; ++i)
+        p->block[i] = x[i] + in[i];
+
+    ++p->counter;
+    ++p->blocks;
+    p->left = 16;
+}
+
+void randkey(struct randpool *p, const void *key)
+{
+    memcpy(p->key, key, sizeof p->key);
+    p->counter = 0;
+    p->blocks = 0;
+    p->left = 0;
+    p->keyed = 1;
+}
+
+void randseed(struct randpool *p, uint64_t seed)
+{
+    uint8_t key[RAND_KEYLEN];
+
+    memset(key, 0, sizeof key);
+    memcpy(key, &seed, sizeof seed);
+
+    randkey(p, key);
+    p->deterministic = 1;
+}
+
+int randstale(const struct randpool *p)
+{
+    return !p->deterministic && p->left == 0
+        && (!p->keyed || p->blocks >= RAND_RESEED_BLOCKS);
+}
+
+uint32_t randnext(struct randpool *p)
+{
+    if (p->left == 0)
+        chacha20(p);
+
+    return p->block[16 - p->left--];
+}
@@ -0,0 +1,38 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stdint.h>
+
+#define RAND_KEYLEN 32
+
+/* Blocks served before a nondeterministic pool asks for a fresh key. */
+#define RAND_RESEED_BLOCKS 16384
+
+/* ChaCha20 keystream serving getrand 4 bytes at a time, so that the host
+ * is only asked for entropy once every RAND_RESEED_BLOCKS * 64 bytes.
+ * A zeroed pool is valid and stale. */
+struct randpool {
+    uint32_t key[RAND_KEYLEN / 4];
+    uint64_t counter;
+    uint32_t block[16];
+    /* Words of block not served yet. */
+    int left;
+    /* Blocks generated with the current key. */
+    uint64_t blocks;
+    int keyed;
+    int deterministic;
+};
+
+/* Key the pool with bytes from the host, e.g. getrandom. */
+void randkey(struct randpool *p, const void *key);
+
+/* Key the pool from seed and never ask for a new key, so the same seed
+ * always produces the same numbers. */
+void randseed(struct randpool *p, uint64_t seed);
+
+/* Nonzero if the pool wants randkey before the next randnext. */
+int randstale(const struct randpool *p);
+
+uint32_t randnext(struct randpool *p);
+
+#endif // RANDOM_H
@@ -0,0 +1,136 @@
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "elfload.h"
+#include "emuerr.h"
+#include "guestmem.h"
+#include "ptraceremote.h"
+#include "remote.h"
+
+/* The stub being built. */
+static pid_t stub;
+
+
+static void remotemmap(uint64_t addr, uint64_t len, int prot, int flags,
+                       int fd, uint64_t offset)
+{
+    struct ptrace_remote_mmap req = {
+        .addr = addr,
+        .length = len,
+        .prot = prot,
+        .flags = flags | MAP_FIXED,
+        .fd = fd,
+        .offset = offset,
+    };
+    long r;
+
+    r = ptrace(PTRACE_REMOTE_MMAP, stub, NULL, &req);
+    SYSERR(r, "PTRACE_REMOTE_MMAP");
+}
+
+static void remotemprotect(uint64_t addr, uint64_t len, int prot)
+{
+    struct ptrace_remote_mprotect req = {
+        .addr = addr,
+        .length = len,
+        .prot = prot,
+    };
+    long r;
+
+    r = ptrace(PTRACE_REMOTE_MPROTECT, stub, NULL, &req);
+    SYSERR(r, "PTRACE_REMOTE_MPROTECT");
+}
+
+static void remotewrite(uint64_t addr, const void *buf, size_t len)
+{
+    writemem(stub, addr, buf, len);
+}
+
+static const struct mapper remotemapper = {
+    .mmap = remotemmap,
+    .mprotect = remotemprotect,
+    .write = remotewrite,
+};
+
+/* Nonzero if the kernel serves remote requests, an empty mprotect. */
+static int supported()
+{
+    struct ptrace_remote_mprotect req = { 0 };
+    long r;
+
+    r = ptrace(PTRACE_REMOTE_MPROTECT, stub, NULL, &req);
+    if (r == -1 && errno == EIO)
+        return 0;
+    SYSERR(r, "PTRACE_REMOTE_MPROTECT");
+
+    return 1;
+}
+
+pid_t remotestart(char *prog[], int n, int fbfd, int flags)
+{
+    struct alienelf elf;
+    struct user_regs_struct regs;
+    int32_t *params;
+    int status;
+    int i;
+    long r;
+
+    stub = fork();
+    SYSERR(stub, "fork");
+
+    if (stub == 0) {
+        r = ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        SYSERR(r, "PTRACE_TRACEME");
+        raise(SIGSTOP);
+
+        /* Only reached if the emulator let us go without a program. */
+        _exit(EEMU);
+    }
+
+    r = waitpid(stub, &status, __WALL);
+    SYSERR(r, "waitpid");
+    if (!WIFSTOPPED(status))
+        EMUERR("The loading stub did not stop");
+
+    r = ptrace(PTRACE_SETOPTIONS, stub, NULL, PTRACE_O_EXITKILL);
+    SYSERR(r, "PTRACE_SETOPTIONS");
+
+    if (!supported()) {
+        r = kill(stub, SIGKILL);
+        SYSERR(r, "kill");
+        r = waitpid(stub, &status, __WALL);
+        SYSERR(r, "waitpid");
+        return -1;
+    }
+
+    elfopen(&elf, prog[0]);
+    elfmap(&elf, &remotemapper, fbfd, flags);
+    elfclose(&elf);
+
+    params = malloc(n * sizeof *params);
+    if (!params) EMUERR("malloc");
+    for (i = 1; i < n; ++i)
+        params[i - 1] = atoi(prog[i]);
+    elfparams(&elf, &remotemapper, n - 1, params);
+    free(params);
+    free(elf.phdrs);
+
+    /* Resuming from the SIGSTOP continues at the entry. */
+    r = ptrace(PTRACE_GETREGS, stub, NULL, &regs);
+    SYSERR(r, "PTRACE_GETREGS");
+    regs.rip = elf.ehdr.e_entry;
+    r = ptrace(PTRACE_SETREGS, stub, NULL, &regs);
+    SYSERR(r, "PTRACE_SETREGS");
+
+    return stub;
+}
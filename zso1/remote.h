@@ -0,0 +1,15 @@
+#ifndef REMOTE_H
+#define REMOTE_H
+
+#include <sys/types.h>
+
+/* Start prog[0] with the n - 1 arguments after it without the loader:
+ * fork a stub that only stops itself, build the alien address space in
+ * it from here with the ptrace remote requests of the zso3 kernel patch
+ * (ptraceremote.h) and point its rip at the entry. Returns the stub,
+ * traced and stopped, ready for the ptrace backend. Returns -1 if the
+ * kernel has no remote requests, the caller then execs the loader.
+ * flags are elfmap's, there is no remote madvise for ELF_HUGE. */
+pid_t remotestart(char *prog[], int n, int fbfd, int flags);
+
+#endif // REMOTE_H
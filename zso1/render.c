@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "display.h"
+#include "emuerr.h"
+#include "render.h"
+#include "screen.h"
+#include "stats.h"
+
+static struct screen *live;
+static const struct display *display;
+
+/* Written by the render thread only, read by renderstats. */
+static uint64_t displayns, presents;
+
+/* Seqlock over live, odd while it is being written. Also the futex the
+ * render thread sleeps on while waiting set. */
+static uint32_t seq;
+static int waiting;
+
+/* rendersync bumps syncs, the render thread sets synced to match. */
+static uint32_t syncs, synced;
+static int clearwanted;
+
+/* Set by renderstop, the render thread returns once it sees it. */
+static pthread_t thread;
+static int running;
+static int stopping;
+
+/* Render thread only: a consistent copy of live, and the screen as it
+ * is on the display. */
+static uint16_t back[MAX_Y][MAX_X];
+static int backx, backy;
+static struct screen front;
+
+
+static void futexwait(uint32_t *addr, uint32_t val)
+{
+    long r;
+
+    r = syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL);
+    if (r == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    SYSERR(r, "FUTEX_WAIT");
+}
+
+static void futexwake(uint32_t *addr)
+{
+    long r;
+
+    r = syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1);
+    SYSERR(r, "FUTEX_WAKE");
+}
+
+void renderbegin()
+{
+    __atomic_store_n(&seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void renderend()
+{
+    __atomic_store_n(&seq, seq + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&waiting, __ATOMIC_SEQ_CST))
+        futexwake(&seq);
+}
+
+void rendersync(int clear)
+{
+    uint32_t req, done;
+
+    if (clear)
+        __atomic_store_n(&clearwanted, 1, __ATOMIC_SEQ_CST);
+    req = __atomic_add_fetch(&syncs, 1, __ATOMIC_SEQ_CST);
+
+    /* An empty change, to wake the render thread. */
+    renderbegin();
+    renderend();
+
+    while ((done = __atomic_load_n(&synced, __ATOMIC_SEQ_CST)) != req)
+        futexwait(&synced, done);
+}
+
+/* Copy live into back, returns the seq the copy is of. Gives up when
+ * stopping, the change in progress may never end then. */
+static uint32_t snapshot()
+{
+    uint32_t s;
+
+    for (;;)
+    {
+        s = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+        if (s & 1) {
+            if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST))
+                return s;
+            __builtin_ia32_pause();
+            continue;
+        }
+
+        memcpy(back, live->cells, sizeof back);
+        backx = live->curx;
+        backy = live->cury;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&seq, __ATOMIC_RELAXED) == s)
+            return s;
+    }
+}
+
+static void draw()
+{
+    uint64_t start;
+
+    if (__atomic_exchange_n(&clearwanted, 0, __ATOMIC_SEQ_CST)) {
+        display->clear();
+        scrinit(&front);
+    }
+
+    scrcopy(&front, back);
+    if (front.curx != backx || front.cury != backy)
+        scrcursor(&front, backx, backy);
+
+    if (!scrdirty(&front))
+        return;
+
+    start = nowns();
+    scrdiff(&front, display->putcells);
+    display->flush(front.curx, front.cury);
+
+    __atomic_fetch_add(&displayns, nowns() - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&presents, 1, __ATOMIC_RELAXED);
+}
+
+static void *render(void *arg)
+{
+    uint32_t drawn, s, req;
+    uint64_t last = 0, now;
+    struct timespec ts;
+
+    drawn = __atomic_load_n(&seq, __ATOMIC_SEQ_CST) - 2;
+
+    for (;;)
+    {
+        req = __atomic_load_n(&syncs, __ATOMIC_SEQ_CST);
+
+        if (req == synced) {
+            /* Sleep while nothing changes, renderend wakes us. */
+            __atomic_store_n(&waiting, 1, __ATOMIC_SEQ_CST);
+            s = __atomic_load_n(&seq, __ATOMIC_SEQ_CST);
+            if (s == drawn
+                    && !__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)) {
+                futexwait(&seq, s);
+                __atomic_store_n(&waiting, 0, __ATOMIC_SEQ_CST);
+                continue;
+            }
+            __atomic_store_n(&waiting, 0, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST))
+                break;
+
+            /* Let changes pile up until the frame is due. */
+            now = nowns();
+            if (now - last < FRAME_USEC * 1000ULL) {
+                ts.tv_sec = 0;
+                ts.tv_nsec = FRAME_USEC * 1000ULL - (now - last);
+                while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+                    ;
+            }
+        }
+
+        drawn = snapshot();
+        if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST))
+            break;
+        draw();
+        last = nowns();
+
+        if (req != synced) {
+            __atomic_store_n(&synced, req, __ATOMIC_SEQ_CST);
+            futexwake(&synced);
+        }
+    }
+
+    (void) arg;
+    return NULL;
+}
+
+void renderstats(struct stats *st)
+{
+    st->displayns = __atomic_load_n(&displayns, __ATOMIC_RELAXED);
+    st->presents = __atomic_load_n(&presents, __ATOMIC_RELAXED);
+}
+
+void renderstop()
+{
+    int r;
+
+    /* Also called at exit, which the render thread may be making. */
+    if (!running || pthread_equal(pthread_self(), thread))
+        return;
+    running = 0;
+
+    /* A change of seq, keeping it odd or even, wakes it for sure. */
+    __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&seq, 2, __ATOMIC_SEQ_CST);
+    futexwake(&seq);
+
+    r = pthread_join(thread, NULL);
+    if (r) LOGTOFILE("pthread_join: %s", strerror(r));
+}
+
+void renderstart(struct screen *s, const struct display *d)
+{
+    sigset_t all, saved;
+    int r;
+
+    live = s;
+    display = d;
+    scrinit(&front);
+
+    /* Signals stay with the emulation thread, which sigwaits for them. */
+    r = sigfillset(&all);
+    SYSERR(r, "sigfillset");
+    r = pthread_sigmask(SIG_BLOCK, &all, &saved);
+    if (r) EMUERR("pthread_sigmask: %s", strerror(r));
+
+    r = pthread_create(&thread, NULL, render, NULL);
+    if (r) EMUERR("pthread_create: %s", strerror(r));
+    running = 1;
+
+    r = pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (r) EMUERR("pthread_sigmask: %s", strerror(r));
+
+    /* Registered after the display's own exit handler, so run before it. */
+    r = atexit(renderstop);
+    if (r) EMUERR("atexit");
+}
@@ -0,0 +1,32 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "display.h"
+#include "screen.h"
+#include "stats.h"
+
+/* The terminal is updated at most once per frame. */
+#define FRAME_USEC 16667
+
+/* Present s, written by the emulation thread, from a thread of our own
+ * so that the alien program never waits for the terminal. */
+void renderstart(struct screen *s, const struct display *d);
+
+/* Stop the render thread and wait for it, before the display goes away.
+ * Also done at exit. */
+void renderstop();
+
+/* Fill in the display time and presents of st from the render thread's
+ * own counters, which it updates atomically. */
+void renderstats(struct stats *st);
+
+/* Every change to the screen goes between these. They never block:
+ * the render thread takes a copy and retries if it raced with one. */
+void renderbegin();
+void renderend();
+
+/* Return once everything drawn so far is on the display, e.g. before
+ * getkey. With clear, the display is blanked first. */
+void rendersync(int clear);
+
+#endif // RENDER_H
@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emuerr.h"
+#include "rewrite.h"
+#include "trap.h"
+
+#define PAGE_SIZE 4096
+
+/* A rewritable site: `mov $imm32, %eax` immediately followed by `syscall`.
+ * Only the mov is overwritten (with a jmp to the site's trampoline), the
+ * syscall stays in place so code jumping straight to it keeps working
+ * through the trapping path.
+ *
+ * Matching bytes are not necessarily that code: they may be data in an
+ * executable segment, or the tail of a longer instruction such as
+ * `41 b8 imm32` (mov $imm32, %r8d). So a candidate is never patched up
+ * front, only by rewritetrap once its syscall has trapped with eax equal
+ * to the mov's immediate, i.e. once it was reached as straight-line code
+ * running through the mov. Candidates right after a prefix byte are not
+ * even considered. */
+#define MOV_EAX 0xb8
+#define MOV_LEN 5
+#define SYSCALL_LEN 2
+#define JMP_REL32 0xe9
+
+/* Trampoline: movabs $after_syscall, %r11; mov $imm32, %eax;
+ *             movabs $fastsys, %rcx; jmp *%rcx */
+#define TRAMP_LEN 32
+
+/* Trampolines must be within rel32 reach of the code. */
+#define REACH 0x7fff0000L
+
+struct site {
+    /* Of the syscall instruction. */
+    uint64_t ip;
+    uint8_t *tramp;
+    int prot;
+    int patched;
+};
+
+/* Candidates of every segment, sorted by ip. */
+static struct site *sites;
+static size_t nsites;
+
+static int issyscall(const uint8_t *p) { return p[0] == 0x0f && p[1] == 0x05; }
+
+/* REX, operand and address size, lock, rep and segment prefixes. */
+static int isprefix(uint8_t b)
+{
+    switch (b) {
+    case 0x26: case 0x2e: case 0x36: case 0x3e: case 0x64: case 0x65:
+    case 0x66: case 0x67: case 0xf0: case 0xf2: case 0xf3:
+        return 1;
+    default:
+        return (b & 0xf0) == 0x40;
+    }
+}
+
+static uint64_t pagedown(uint64_t addr)
+{
+    return addr & ~(uint64_t) (PAGE_SIZE - 1);
+}
+
+/* Collect rewritable sites (offsets of their syscall instruction).
+ * A mov whose bytes overlap another syscall is ambiguous and skipped,
+ * so is a site with a page outside [from, to). */
+static size_t findsites(const uint8_t *code, uint64_t len, uint64_t from,
+                        uint64_t to, uint64_t *sites, int *syscalls)
+{
+    uint64_t i, mov;
+    uint64_t lastend = 0;
+    size_t n = 0;
+
+    *syscalls = 0;
+    for (i = 0; i + 1 < len; ++i)
+    {
+        if (!issyscall(code + i))
+            continue;
+
+        ++*syscalls;
+        mov = (uint64_t) code + i - MOV_LEN;
+        if (i >= lastend + MOV_LEN && code[i - MOV_LEN] == MOV_EAX
+                && (i == MOV_LEN || !isprefix(code[i - MOV_LEN - 1]))
+                && pagedown(mov) >= from
+                && pagedown(mov + MOV_LEN - 1) + PAGE_SIZE <= to) {
+            if (sites)
+                sites[n] = i;
+            ++n;
+        }
+
+        lastend = i + SYSCALL_LEN;
+        ++i;
+    }
+
+    return n;
+}
+
+/* Find room for size bytes of trampolines close to [start, end). */
+static uint8_t *trampalloc(uint64_t start, uint64_t end, size_t size)
+{
+    uint64_t hint;
+    void *addr;
+
+    hint = (end + PAGE_SIZE - 1) & ~(uint64_t) (PAGE_SIZE - 1);
+    for (; hint + size - start < REACH; hint += PAGE_SIZE)
+    {
+        addr = mmap((void *) hint, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
+                    -1, 0);
+        if (addr == (void *) hint)
+            return addr;
+
+        /* Kernels without MAP_FIXED_NOREPLACE treat it as a mere hint. */
+        if (addr != MAP_FAILED)
+            munmap(addr, size);
+    }
+
+    return NULL;
+}
+
+static void emittramp(uint8_t *t, uint8_t *site)
+{
+    uint64_t ret = (uint64_t) site + SYSCALL_LEN;
+    uint64_t target = (uint64_t) fastsys;
+
+    t[0] = 0x49; t[1] = 0xbb;                   /* movabs $ret, %r11 */
+    memcpy(t + 2, &ret, 8);
+    memcpy(t + 10, site - MOV_LEN, MOV_LEN);    /* the original mov */
+    t[15] = 0x48; t[16] = 0xb9;                 /* movabs $target, %rcx */
+    memcpy(t + 17, &target, 8);
+    t[25] = 0xff; t[26] = 0xe1;                 /* jmp *%rcx */
+    memset(t + 27, 0xcc, TRAMP_LEN - 27);
+}
+
+static int cmpsite(const void *a, const void *b)
+{
+    const struct site *x = a, *y = b;
+
+    return x->ip < y->ip ? -1 : x->ip > y->ip;
+}
+
+void rewrite(uint64_t start, uint64_t len, int prot, uint64_t from,
+             uint64_t to)
+{
+    uint8_t *code = (uint8_t *) start;
+    uint8_t *tramp;
+    uint64_t *offs;
+    size_t n, size, i;
+    struct site *site;
+    int syscalls;
+    int r;
+
+    if (!initfastsys()) {
+        LOGTOFILE("rewrite: no xsave, syscall sites left alone");
+        return;
+    }
+
+    n = findsites(code, len, from, to, NULL, &syscalls);
+    if (!n) {
+        LOGTOFILE("rewrite: %#lx: 0 of %d syscall sites rewritable",
+                  start, syscalls);
+        return;
+    }
+
+    size = (n * TRAMP_LEN + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    tramp = trampalloc(start, start + len, size);
+    if (!tramp) {
+        LOGTOFILE("rewrite: %#lx: no room for trampolines, 0 of %d syscall "
+                  "sites rewritable", start, syscalls);
+        return;
+    }
+
+    offs = malloc(n * sizeof *offs);
+    sites = realloc(sites, (nsites + n) * sizeof *sites);
+    if (!offs || !sites) EMUERR("rewrite: malloc");
+    findsites(code, len, from, to, offs, &syscalls);
+
+    for (i = 0; i < n; ++i)
+    {
+        site = &sites[nsites + i];
+        site->ip = start + offs[i];
+        site->tramp = tramp + i * TRAMP_LEN;
+        site->prot = prot;
+        site->patched = 0;
+
+        emittramp(site->tramp, code + offs[i]);
+    }
+    free(offs);
+
+    nsites += n;
+    qsort(sites, nsites, sizeof *sites, cmpsite);
+
+    r = mprotect(tramp, size, PROT_READ | PROT_EXEC);
+    SYSERR(r, "mprotect trampolines");
+
+    LOGTOFILE("rewrite: %#lx: %zu of %d syscall sites rewritable, each "
+              "once first reached", start, n, syscalls);
+}
+
+int rewritetrap(uint64_t ip, uint64_t rax)
+{
+    struct site key, *site;
+    uint8_t *mov;
+    uint64_t page, pagelen;
+    uint32_t imm;
+    int32_t rel;
+
+    if (!nsites)
+        return 0;
+
+    key.ip = ip;
+    site = bsearch(&key, sites, nsites, sizeof *sites, cmpsite);
+    if (!site || site->patched)
+        return 0;
+
+    /* Jumped straight to the syscall, or not a mov after all. */
+    mov = (uint8_t *) ip - MOV_LEN;
+    memcpy(&imm, mov + 1, sizeof imm);
+    if (rax != imm)
+        return 0;
+
+    /* Only rawsys gets past the seccomp filter. findsites made sure these
+     * pages are all the segment's, prot is theirs to restore. */
+    page = pagedown((uint64_t) mov);
+    pagelen = pagedown(ip - 1) + PAGE_SIZE - page;
+    if (rawsys(SYS_mprotect, page, pagelen, site->prot | PROT_WRITE, 0, 0))
+        return 0;
+
+    rel = (int32_t) ((int64_t) site->tramp - (int64_t) (mov + MOV_LEN));
+    memcpy(mov + 1, &rel, sizeof rel);
+    mov[0] = JMP_REL32;
+    site->patched = 1;
+
+    rawsys(SYS_mprotect, page, pagelen, site->prot, 0, 0);
+    return 1;
+}
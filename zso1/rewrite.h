@@ -0,0 +1,21 @@
+#ifndef REWRITE_H
+#define REWRITE_H
+
+#include <stdint.h>
+
+/* Prepare trampolines to fastsys for the `mov $imm32, %eax; syscall`
+ * sites in the writable, already loaded code at [start, start + len),
+ * mapped prot once the alien program runs, logging how many syscall
+ * sites qualify. Patching a site sets the protection of the pages it
+ * spans, so only sites within the pages [from, to), which no other
+ * segment has a part of, qualify. None is patched yet, see rewritetrap. */
+void rewrite(uint64_t start, uint64_t len, int prot, uint64_t from,
+             uint64_t to);
+
+/* From the SIGSYS handler, after serving the syscall at ip which trapped
+ * with rax: if ip is a site rewrite prepared and rax is what its mov
+ * loads, point the mov at the trampoline. Later calls skip the trap.
+ * Returns nonzero if the site was patched now. */
+int rewritetrap(uint64_t ip, uint64_t rax);
+
+#endif // REWRITE_H
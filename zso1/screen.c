@@ -0,0 +1,118 @@
+#include <stdint.h>
+
+#include "screen.h"
+
+void scrinit(struct screen *s)
+{
+    int x, y;
+
+    for (y = 0; y < MAX_Y; ++y)
+    {
+        for (x = 0; x < MAX_X; ++x)
+        {
+            s->cells[y][x] = CELL_NONE;
+            s->shown[y][x] = CELL_NONE;
+        }
+        s->dirtyfrom[y] = MAX_X;
+        s->dirtyto[y] = 0;
+    }
+    s->dirty = 0;
+
+    s->curx = 0;
+    s->cury = 0;
+    s->curdirty = 0;
+}
+
+void scrprint(struct screen *s, int x, int y, const uint16_t *chars, int n)
+{
+    uint16_t *row;
+    int i;
+    int from = MAX_X, to = 0;
+
+    row = s->cells[y];
+    for (i = 0; i < n; ++i)
+    {
+        uint16_t cell = chars[i] & CELL_MASK;
+
+        if (row[x + i] == cell)
+            continue;
+
+        row[x + i] = cell;
+        if (from > x + i) from = x + i;
+        to = x + i + 1;
+    }
+
+    if (from >= to)
+        return;
+
+    if (s->dirtyfrom[y] > from) s->dirtyfrom[y] = from;
+    if (s->dirtyto[y] < to) s->dirtyto[y] = to;
+    s->dirty = 1;
+}
+
+void scrcursor(struct screen *s, int x, int y)
+{
+    s->curx = x;
+    s->cury = y;
+    s->curdirty = 1;
+}
+
+void scrcopy(struct screen *s, const uint16_t cells[MAX_Y][MAX_X])
+{
+    int x, y, start;
+
+    for (y = 0; y < MAX_Y; ++y)
+    {
+        for (x = 0; x < MAX_X; )
+        {
+            if (cells[y][x] == CELL_NONE) {
+                ++x;
+                continue;
+            }
+
+            start = x;
+            while (x < MAX_X && cells[y][x] != CELL_NONE)
+                ++x;
+            scrprint(s, start, y, cells[y] + start, x - start);
+        }
+    }
+}
+
+int scrdirty(const struct screen *s)
+{
+    return s->dirty || s->curdirty;
+}
+
+void scrdiff(struct screen *s, putcells_t put)
+{
+    int x, y, start;
+
+    for (y = 0; y < MAX_Y && s->dirty; ++y)
+    {
+        uint16_t *cells = s->cells[y];
+        uint16_t *shown = s->shown[y];
+
+        x = s->dirtyfrom[y];
+        while (x < s->dirtyto[y])
+        {
+            if (cells[x] == shown[x]) {
+                ++x;
+                continue;
+            }
+
+            start = x;
+            while (x < s->dirtyto[y] && cells[x] != shown[x])
+            {
+                shown[x] = cells[x];
+                ++x;
+            }
+            put(start, y, cells + start, x - start);
+        }
+
+        s->dirtyfrom[y] = MAX_X;
+        s->dirtyto[y] = 0;
+    }
+
+    s->dirty = 0;
+    s->curdirty = 0;
+}
@@ -0,0 +1,52 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include <stdint.h>
+
+#define MAX_X 80
+#define MAX_Y 24
+
+/* Cell layout: bits 0-7 character, bits 8-10 color. */
+#define CELL_CH(Cell) ((Cell) & 0xFF)
+#define CELL_COLOR(Cell) ((Cell) >> 8 & 7)
+#define CELL_MASK 0x07FF
+
+/* Never a valid (masked) cell, marks positions nothing was drawn at. */
+#define CELL_NONE 0xFFFF
+
+/* Emulator-owned copy of the alien screen.
+ * `cells` is what the alien program wants to see, `shown` is what was
+ * last presented on the terminal. Only spans marked dirty are compared. */
+struct screen {
+    uint16_t cells[MAX_Y][MAX_X];
+    uint16_t shown[MAX_Y][MAX_X];
+
+    /* Dirty span of a row is [dirtyfrom, dirtyto), empty if from >= to. */
+    int dirtyfrom[MAX_Y];
+    int dirtyto[MAX_Y];
+    int dirty;
+
+    int curx, cury;
+    int curdirty;
+};
+
+typedef void (*putcells_t)(int x, int y, const uint16_t *cells, int n);
+
+void scrinit(struct screen *s);
+
+/* Store n cells at (x, y). The caller validates the range. */
+void scrprint(struct screen *s, int x, int y, const uint16_t *chars, int n);
+
+void scrcursor(struct screen *s, int x, int y);
+
+/* scrprint every cell of a whole screen that is not CELL_NONE. */
+void scrcopy(struct screen *s, const uint16_t cells[MAX_Y][MAX_X]);
+
+/* Nonzero if anything changed since the last scrdiff. */
+int scrdirty(const struct screen *s);
+
+/* Call put for every run of cells that differs from what was shown
+ * and mark the whole screen clean. */
+void scrdiff(struct screen *s, putcells_t put);
+
+#endif // SCREEN_H
@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/user.h>
+#include <linux/elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alienos.h"
+#include "elfload.h"
+#include "emuerr.h"
+#include "guestmem.h"
+#include "snapshot.h"
+
+/* Pages read from the child at once. */
+#define CHUNK_PAGES 256
+
+#define MAX_REGIONS 64
+
+
+static const char zeros[PAGE_SIZE];
+
+static void safepwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    if (pwrite(fd, buf, count, offset) != (ssize_t) count)
+        SYSERR(-1, "snapshot: write");
+}
+
+static void safepread(int fd, void *buf, size_t count, off_t offset)
+{
+    if (pread(fd, buf, count, offset) != (ssize_t) count)
+        EMUERR("snapshot: short read");
+}
+
+static size_t bitmapsize(uint64_t len)
+{
+    return (len / PAGE_SIZE + 63) / 64 * 8;
+}
+
+/* The page-aligned span of a segment, 0 for the others. */
+static int segregion(const Elf64_Phdr *phdr, struct snapregion *reg)
+{
+    uint64_t end;
+
+    switch (phdr->p_type) {
+    case PT_LOAD:
+    case PT_PARAMS:
+        reg->prot = elfprot(phdr->p_flags);
+        break;
+    case PT_FRAMEBUF:
+        reg->prot = PROT_READ | PROT_WRITE;
+        break;
+    default:
+        return 0;
+    }
+
+    end = phdr->p_vaddr + (phdr->p_type == PT_FRAMEBUF ? PAGE_SIZE
+                                                       : phdr->p_memsz);
+    reg->start = phdr->p_vaddr - phdr->p_vaddr % PAGE_SIZE;
+    reg->len = (end - reg->start + PAGE_SIZE - 1)
+               & ~(uint64_t) (PAGE_SIZE - 1);
+    reg->stack = 0;
+
+    return reg->len != 0;
+}
+
+/* The mapping of the child rsp points into, from /proc/pid/maps. */
+static int stackregion(pid_t child, uint64_t rsp, struct snapregion *reg)
+{
+    char path[64];
+    char line[512];
+    unsigned long start, end;
+    FILE *f;
+    int found = 0;
+
+    snprintf(path, sizeof path, "/proc/%d/maps", (int) child);
+    f = fopen(path, "r");
+    if (!f) SYSERR(-1, "fopen %s", path);
+
+    while (!found && fgets(line, sizeof line, f))
+    {
+        if (sscanf(line, "%lx-%lx", &start, &end) != 2)
+            continue;
+        if (rsp < start || rsp >= end)
+            continue;
+
+        reg->start = start;
+        reg->len = end - start;
+        reg->prot = PROT_READ | PROT_WRITE;
+        reg->stack = 1;
+        found = 1;
+    }
+
+    fclose(f);
+    return found;
+}
+
+/* Nonzero if reg overlaps one of the n in regs. */
+static int overlaps(const struct snapregion *reg,
+                    const struct snapregion *regs, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i)
+        if (reg->start < regs[i].start + regs[i].len
+                && regs[i].start < reg->start + reg->len)
+            return 1;
+
+    return 0;
+}
+
+/* Write reg at offset off, returns the offset past it. */
+static off_t saveregion(int fd, off_t off, pid_t child,
+                        const struct snapregion *reg)
+{
+    static char chunk[CHUNK_PAGES * PAGE_SIZE];
+
+    uint64_t *bitmap;
+    uint64_t page, pages, n, i;
+    off_t data;
+
+    pages = reg->len / PAGE_SIZE;
+    bitmap = calloc(1, bitmapsize(reg->len));
+    if (!bitmap) EMUERR("calloc");
+
+    /* The bitmap goes in front of the pages once it is known. */
+    data = off + sizeof *reg + bitmapsize(reg->len);
+
+    for (page = 0; page < pages; page += n)
+    {
+        n = pages - page < CHUNK_PAGES ? pages - page : CHUNK_PAGES;
+        readmem(child, chunk, reg->start + page * PAGE_SIZE, n * PAGE_SIZE);
+
+        for (i = 0; i < n; ++i)
+        {
+            if (!memcmp(chunk + i * PAGE_SIZE, zeros, PAGE_SIZE))
+                continue;
+
+            bitmap[(page + i) / 64] |= 1ULL << (page + i) % 64;
+            safepwrite(fd, chunk + i * PAGE_SIZE, PAGE_SIZE, data);
+            data += PAGE_SIZE;
+        }
+    }
+
+    safepwrite(fd, reg, sizeof *reg, off);
+    safepwrite(fd, bitmap, bitmapsize(reg->len), off + sizeof *reg);
+    free(bitmap);
+
+    return data;
+}
+
+void snapsave(const char *file, pid_t child, const char *prog,
+              const struct screen *screen, const struct randpool *pool)
+{
+    struct snapheader h;
+    struct snapregion regs[MAX_REGIONS];
+    struct alienelf elf;
+    uint64_t stored = 0;
+    off_t off;
+    int fd;
+    int i;
+    long r;
+
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, SNAP_MAGIC, sizeof h.magic);
+
+    r = ptrace(PTRACE_GETREGS, child, NULL, &h.regs);
+    SYSERR(r, "PTRACE_GETREGS");
+    r = ptrace(PTRACE_GETFPREGS, child, NULL, &h.fpregs);
+    SYSERR(r, "PTRACE_GETFPREGS");
+
+    memcpy(h.cells, screen->cells, sizeof h.cells);
+    h.curx = screen->curx;
+    h.cury = screen->cury;
+    h.pool = *pool;
+
+    elfopen(&elf, prog);
+    h.entry = elf.ehdr.e_entry;
+    for (i = 0; i < elf.ehdr.e_phnum; ++i)
+    {
+        if (h.nregions == MAX_REGIONS - 1)
+            EMUERR("snapshot: too many segments");
+        if (segregion(&elf.phdrs[i], &regs[h.nregions]))
+            ++h.nregions;
+    }
+    elfclose(&elf);
+    free(elf.phdrs);
+
+    /* The stack the loader left, unless the program moved it into its
+     * own memory. */
+    if (stackregion(child, h.regs.rsp, &regs[h.nregions])
+            && !overlaps(&regs[h.nregions], regs, h.nregions))
+        ++h.nregions;
+
+    fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    SYSERR(fd, "open %s", file);
+
+    off = sizeof h;
+    for (i = 0; i < (int) h.nregions; ++i)
+    {
+        off = saveregion(fd, off, child, &regs[i]);
+        stored += regs[i].len;
+    }
+    safepwrite(fd, &h, sizeof h, 0);
+
+    r = close(fd);
+    SYSERR(r, "close %s", file);
+
+    LOGTOFILE("snapshot: %s: %u regions, %lu KiB, %lu KiB stored",
+              file, h.nregions, (unsigned long) stored / 1024,
+              (unsigned long) (off - sizeof h) / 1024);
+}
+
+static int opensnapshot(const char *file, struct snapheader *h)
+{
+    int fd;
+
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    SYSERR(fd, "open %s", file);
+
+    safepread(fd, h, sizeof *h, 0);
+    if (memcmp(h->magic, SNAP_MAGIC, sizeof h->magic))
+        EMUERR("%s is not a snapshot", file);
+
+    return fd;
+}
+
+void snapheader(const char *file, struct snapheader *h)
+{
+    int r;
+
+    r = close(opensnapshot(file, h));
+    SYSERR(r, "close");
+}
+
+void snapmap(const char *file, uint64_t entry)
+{
+    struct snapheader h;
+    struct snapregion reg;
+    uint64_t *bitmap;
+    uint64_t page;
+    char *addr;
+    off_t off;
+    void *p;
+    int fd;
+    int r;
+    uint32_t i;
+
+    fd = opensnapshot(file, &h);
+    if (h.entry != entry)
+        EMUERR("%s is a snapshot of another program", file);
+
+    off = sizeof h;
+    for (i = 0; i < h.nregions; ++i)
+    {
+        safepread(fd, &reg, sizeof reg, off);
+        off += sizeof reg;
+
+        bitmap = malloc(bitmapsize(reg.len));
+        if (!bitmap) EMUERR("malloc");
+        safepread(fd, bitmap, bitmapsize(reg.len), off);
+        off += bitmapsize(reg.len);
+
+        if (reg.stack) {
+            /* Where our own stack is, the old one cannot go. */
+            p = mmap((void *) reg.start, reg.len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_GROWSDOWN
+                     | MAP_FIXED_NOREPLACE, -1, 0);
+            SYS2ERR(p, "mmap snapshot stack");
+            if (p != (void *) reg.start)
+                EMUERR("The snapshot's stack address is taken");
+        }
+        else {
+            r = mprotect((void *) reg.start, reg.len, PROT_READ | PROT_WRITE);
+            SYSERR(r, "mprotect");
+        }
+
+        for (page = 0; page < reg.len / PAGE_SIZE; ++page)
+        {
+            addr = (char *) reg.start + page * PAGE_SIZE;
+
+            if (bitmap[page / 64] >> page % 64 & 1) {
+                safepread(fd, addr, PAGE_SIZE, off);
+                off += PAGE_SIZE;
+            }
+            /* Only touch what is not zero already, e.g. untouched bss. */
+            else if (memcmp(addr, zeros, PAGE_SIZE))
+                memset(addr, 0, PAGE_SIZE);
+        }
+        free(bitmap);
+
+        r = mprotect((void *) reg.start, reg.len, reg.prot);
+        SYSERR(r, "mprotect");
+    }
+
+    r = close(fd);
+    SYSERR(r, "close");
+}
@@ -0,0 +1,56 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <sys/types.h>
+#include <sys/user.h>
+#include <stdint.h>
+
+#include "random.h"
+#include "screen.h"
+
+/* A traced alien program frozen right after a syscall was served, emu -C,
+ * to be resumed with emu -R. The file is a snapheader and nregions
+ * regions, each a snapregion, a bitmap with a bit per page (rounded up to
+ * 8 bytes, set for pages stored) and the stored pages one after another.
+ * Pages of zeros are not stored. */
+
+#define SNAP_MAGIC "ALIENSN1"
+
+struct snapheader {
+    char magic[8];
+    /* Of the program, to refuse resuming another one. */
+    uint64_t entry;
+
+    struct user_regs_struct regs;
+    struct user_fpregs_struct fpregs;
+
+    /* What the alien program drew, the rest of the screen is redrawn. */
+    uint16_t cells[MAX_Y][MAX_X];
+    int32_t curx, cury;
+    struct randpool pool;
+
+    uint32_t nregions;
+    uint32_t reserved;
+};
+
+/* Pages of the program's segments (PT_LOAD, PT_PARAMS, PT_FRAMEBUF), or
+ * of the stack, which the loader maps anew. */
+struct snapregion {
+    uint64_t start, len;
+    int32_t prot;
+    int32_t stack;
+};
+
+/* Write the stopped child to file: its registers and memory, the
+ * segments of prog and the mapping rsp is in, and screen and pool. */
+void snapsave(const char *file, pid_t child, const char *prog,
+              const struct screen *screen, const struct randpool *pool);
+
+/* Read the header of file, exits unless it is a snapshot. */
+void snapheader(const char *file, struct snapheader *h);
+
+/* Put back every region of file into our own address space, the
+ * loader's half of resuming. entry is the program's, to match. */
+void snapmap(const char *file, uint64_t entry);
+
+#endif // SNAPSHOT_H
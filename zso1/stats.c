@@ -0,0 +1,72 @@
+#include <errno.h>
+#include <time.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emuerr.h"
+#include "stats.h"
+
+static const char *sysnames[STATS_NSYS] = {
+    "end", "getrand", "getkey", "print", "setcursor", "printspans",
+    "present", "invalid",
+};
+
+uint64_t nowns()
+{
+    struct timespec ts;
+    int r;
+
+    r = clock_gettime(CLOCK_MONOTONIC, &ts);
+    SYSERR(r, "clock_gettime");
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void statsrecord(struct stats *s, long nr, uint64_t ns)
+{
+    struct sysstats *sys;
+    int bucket = 0;
+
+    if (nr < 0 || nr >= STATS_NSYS)
+        nr = STATS_NSYS - 1;
+    sys = &s->sys[nr];
+
+    while (bucket < STATS_BUCKETS - 1 && ns >> (bucket + 1))
+        ++bucket;
+
+    ++sys->count;
+    sys->totalns += ns;
+    ++sys->hist[bucket];
+}
+
+void statsdump(const struct stats *s, const char *backend, FILE *f)
+{
+    const struct sysstats *sys;
+    int i, j;
+
+    fprintf(f, "{\"backend\": \"%s\", \"syscalls\": {", backend);
+    for (i = 0; i < STATS_NSYS; ++i)
+    {
+        sys = &s->sys[i];
+        fprintf(f, "%s\"%s\": {\"count\": %llu, \"total_ns\": %llu, "
+                   "\"hist_log2_ns\": [", i ? ", " : "", sysnames[i],
+                (unsigned long long) sys->count,
+                (unsigned long long) sys->totalns);
+        for (j = 0; j < STATS_BUCKETS; ++j)
+            fprintf(f, "%s%llu", j ? ", " : "",
+                    (unsigned long long) sys->hist[j]);
+        fprintf(f, "]}");
+    }
+    fprintf(f, "}, \"ptrace_ns\": %llu, \"handler_ns\": %llu, "
+               "\"display_ns\": %llu, \"presents\": %llu, "
+               "\"keywait_ns\": %llu, \"rewritten_sites\": %llu}\n",
+            (unsigned long long) s->ptracens,
+            (unsigned long long) s->handlerns,
+            (unsigned long long) s->displayns,
+            (unsigned long long) s->presents,
+            (unsigned long long) s->keywaitns,
+            (unsigned long long) s->rewritten);
+}
@@ -0,0 +1,44 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* AlienOS syscalls 0-6, anything else is counted as number 7. */
+#define STATS_NSYS 8
+/* Bucket i counts latencies in [2^i, 2^(i+1)) ns, the last one the rest. */
+#define STATS_BUCKETS 32
+
+struct sysstats {
+    uint64_t count;
+    uint64_t totalns;
+    uint64_t hist[STATS_BUCKETS];
+};
+
+/* Where emulation time goes. With the ptrace backend a syscall's latency
+ * runs from its SYSEMU stop to the resume; with the seccomp backends it is
+ * the time spent in the in-process handler. */
+struct stats {
+    struct sysstats sys[STATS_NSYS];
+
+    /* ptrace requests and guest memory reads. */
+    uint64_t ptracens;
+    /* Emulating syscalls, minus the ptrace and display time within. */
+    uint64_t handlerns;
+    /* Drawing: diffing the shadow screen and display flushes. */
+    uint64_t displayns;
+    uint64_t presents;
+    /* Blocked waiting for the user in getkey. */
+    uint64_t keywaitns;
+    /* -b rewrite: syscall sites patched to skip the trap. */
+    uint64_t rewritten;
+};
+
+uint64_t nowns();
+
+void statsrecord(struct stats *s, long nr, uint64_t ns);
+
+/* Write s as one JSON object. */
+void statsdump(const struct stats *s, const char *backend, FILE *f);
+
+#endif // STATS_H
@@ -0,0 +1,620 @@
+#define _GNU_SOURCE
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/user.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alienabi.h"
+#include "alienos.h"
+#include "ansi.h"
+#include "emuerr.h"
+#include "framebuf.h"
+#include "guestmem.h"
+#include "random.h"
+#include "screen.h"
+#include "stats.h"
+#include "supervise.h"
+
+/* Same frame rate as a single emulated program gets. */
+#define FRAME_NS 16667000LL
+
+#define MAX_SESSION_ARGS 1024
+#define KEYQ_SIZE 64
+
+#define MY_SYS_getrandom 318
+
+typedef struct user_regs_struct reg_t;
+
+/* One alien program. Its terminal is the slave side of pty, whatever is
+ * attached there (e.g. `screen /dev/pts/N`) sees the screen and types. */
+struct session {
+    pid_t pid;
+    int pty;
+    /* Kept open so the pty stays usable with nobody attached. */
+    int slave;
+
+    struct screen screen;
+    struct randpool pool;
+    uint64_t lastpresent;
+    /* NULL unless the program has a PT_FRAMEBUF segment. */
+    struct framebuf *fb;
+
+    /* Escape sequences for the terminal, term.buf from outdone on is not
+     * written yet. Nothing new is presented before it is, so that is at
+     * most one frame. */
+    struct ansi term;
+    size_t outdone;
+
+    /* Keys typed before getkey asked for them, and the escape sequence
+     * parser state: 0 plain, 1 after ESC, 2 after ESC [ (or O). */
+    int keys[KEYQ_SIZE];
+    int keyhead, nkeys;
+    int escstate;
+    /* Stopped in getkey until a key arrives. */
+    int keywanted;
+
+    int done;
+    int status;
+};
+
+static struct session *sessions;
+static int nsessions;
+
+/* The session scrdiff is drawing, putcells has no context argument. */
+static struct session *drawing;
+
+
+/* Hand the terminal as much output as it takes without blocking. */
+static void flushout(struct session *s)
+{
+    ssize_t r;
+
+    while (s->outdone < s->term.len)
+    {
+        r = write(s->pty, s->term.buf + s->outdone,
+                  s->term.len - s->outdone);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1 && errno == EAGAIN)
+            return;
+        SYSERR(r, "write pty");
+
+        s->outdone += r;
+    }
+
+    s->term.len = s->outdone = 0;
+}
+
+static void putcells(int x, int y, const uint16_t *cells, int n)
+{
+    ansiputcells(&drawing->term, x, y, cells, n);
+}
+
+/* Take what the program drew into its framebuffer along. */
+static void fbsync(struct session *s)
+{
+    if (s->fb)
+        scrcopy(&s->screen, s->fb->cells);
+}
+
+static void present(struct session *s)
+{
+    fbsync(s);
+
+    if (scrdirty(&s->screen)) {
+        drawing = s;
+        scrdiff(&s->screen, putcells);
+        ansicursor(&s->term, s->screen.curx, s->screen.cury);
+        flushout(s);
+    }
+
+    s->lastpresent = nowns();
+}
+
+/* Whether the session has a frame to present, and when. A framebuffer
+ * is looked at every frame, whether anything changed or not. */
+static int presentdue(struct session *s, uint64_t now, int64_t *wait)
+{
+    if (s->done || (!s->fb && !scrdirty(&s->screen)))
+        return 0;
+
+    *wait = s->lastpresent + FRAME_NS - now;
+    /* A terminal not keeping up gets the next frame once it drained. */
+    return s->term.len == 0;
+}
+
+static void finish(struct session *s, int status)
+{
+    int r;
+
+    s->done = 1;
+    s->status = status;
+
+    /* Reaped by the event loop like any other state change. */
+    if (s->pid != -1) {
+        r = kill(s->pid, SIGKILL);
+        SYSERR(r, "kill");
+    }
+}
+
+/* Only this session is lost when its alien program misbehaves. */
+static void fail(struct session *s, const char *msg)
+{
+    LOGTOFILE("session %d: %s", (int) (s - sessions) + 1, msg);
+    finish(s, EEMU);
+}
+
+static void resume(struct session *s)
+{
+    long r;
+
+    r = ptrace(PTRACE_SYSEMU, s->pid, NULL, NULL);
+    SYSERR(r, "PTRACE_SYSEMU");
+}
+
+static void setrax(struct session *s, reg_t *regs, uint64_t rax)
+{
+    long r;
+
+    regs->rax = rax;
+    r = ptrace(PTRACE_SETREGS, s->pid, NULL, regs);
+    SYSERR(r, "PTRACE_SETREGS");
+}
+
+static void answerkey(struct session *s)
+{
+    reg_t regs;
+    long r;
+
+    r = ptrace(PTRACE_GETREGS, s->pid, NULL, &regs);
+    SYSERR(r, "PTRACE_GETREGS");
+
+    setrax(s, &regs, s->keys[s->keyhead]);
+    s->keyhead = (s->keyhead + 1) % KEYQ_SIZE;
+    --s->nkeys;
+
+    s->keywanted = 0;
+    resume(s);
+}
+
+static long hostrandom(void *buf, size_t len)
+{
+    return syscall(MY_SYS_getrandom, buf, len, 0);
+}
+
+/* Nonzero if the session failed. */
+static int print(struct session *s, const reg_t *regs)
+{
+    static struct abiprint p;
+
+    struct iovec local, remote;
+    const char *err;
+
+    err = abiprintargs(regs->rdi, regs->rsi, regs->rdx, regs->r10, &p,
+                       &local, &remote);
+    if (err) {
+        fail(s, err);
+        return -1;
+    }
+    if (tryreadmemv(s->pid, &local, &remote, 1)) {
+        fail(s, "print: invalid chars");
+        return -1;
+    }
+
+    abiprint(&s->screen, &p);
+    return 0;
+}
+
+/* Nonzero if the session failed. */
+static int printspans(struct session *s, const reg_t *regs)
+{
+    static struct abispans p;
+    static struct iovec local[ALIEN_MAX_SPANS], remote[ALIEN_MAX_SPANS];
+
+    const char *err;
+
+    err = abispansargs(regs->rdi, regs->rsi, &p, local, remote);
+    if (err) {
+        fail(s, err);
+        return -1;
+    }
+    if (tryreadmemv(s->pid, local, remote, 1)) {
+        fail(s, "printspans: invalid spans");
+        return -1;
+    }
+
+    err = abispanschars(&p, local, remote);
+    if (err) {
+        fail(s, err);
+        return -1;
+    }
+    if (tryreadmemv(s->pid, local, remote, p.n)) {
+        fail(s, "printspans: invalid chars");
+        return -1;
+    }
+
+    abispans(&s->screen, &p);
+    return 0;
+}
+
+/* Same syscalls as handlesyscall in emu.c, except that getkey parks the
+ * session instead of blocking everybody. */
+static void handlesyscall(struct session *s)
+{
+    reg_t regs;
+    const char *err;
+    uint32_t rand;
+    int status, x, y;
+    long r;
+
+    r = ptrace(PTRACE_GETREGS, s->pid, NULL, &regs);
+    SYSERR(r, "PTRACE_GETREGS");
+
+    switch (regs.orig_rax) {
+    case 0:
+        err = abiend(regs.rdi, &status);
+        if (err) {
+            fail(s, err);
+            return;
+        }
+        present(s);
+        finish(s, status);
+        return;
+    case 1:
+        err = abigetrand(&s->pool, hostrandom, &rand);
+        if (err) EMUERR("%s", err);
+        setrax(s, &regs, rand);
+        break;
+    case 2:
+        if (!s->nkeys) {
+            s->keywanted = 1;
+            present(s);
+            return;
+        }
+        answerkey(s);
+        return;
+    case 3:
+        if (print(s, &regs))
+            return;
+        break;
+    case 4:
+        err = abicursor(regs.rdi, regs.rsi, &x, &y);
+        if (err) {
+            fail(s, err);
+            return;
+        }
+        scrcursor(&s->screen, x, y);
+        break;
+    case 5:
+        if (printspans(s, &regs))
+            return;
+        break;
+    case 6:
+        /* Shown within a frame, like print. */
+        fbsync(s);
+        break;
+    default:
+        fail(s, "invalid syscall number");
+        return;
+    }
+
+    resume(s);
+}
+
+static struct session *findsession(pid_t pid)
+{
+    int i;
+
+    for (i = 0; i < nsessions; ++i)
+        if (sessions[i].pid == pid)
+            return &sessions[i];
+
+    return NULL;
+}
+
+/* Serve every state change that happened since the last call. */
+static int reap()
+{
+    struct session *s;
+    pid_t pid;
+    int status;
+    int live = 0;
+    int i;
+
+    for (;;)
+    {
+        pid = waitpid(-1, &status, __WALL | WNOHANG);
+        if (pid == -1 && errno == ECHILD)
+            break;
+        SYSERR(pid, "waitpid");
+        if (pid == 0)
+            break;
+
+        s = findsession(pid);
+        if (!s)
+            continue;
+
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            /* We get here for the sessions we finish ourselves, too. */
+            s->pid = -1;
+            if (!s->done)
+                fail(s, "The alien program was terminated by a signal");
+            continue;
+        }
+
+        if (s->done)
+            continue;
+
+        if (WSTOPSIG(status) != (SIGTRAP | 0x80)) {
+            fail(s, "An unexpected signal delivered to the alien program");
+            continue;
+        }
+
+        handlesyscall(s);
+    }
+
+    for (i = 0; i < nsessions; ++i)
+        if (sessions[i].pid != -1)
+            ++live;
+
+    return live;
+}
+
+static void pushkey(struct session *s, int key)
+{
+    if (s->nkeys == KEYQ_SIZE)
+        return;
+
+    s->keys[(s->keyhead + s->nkeys) % KEYQ_SIZE] = key;
+    ++s->nkeys;
+}
+
+/* Parse what was typed the way ansikey does, across reads. */
+static void readkeys(struct session *s)
+{
+    char buf[256];
+    ssize_t r;
+    int i;
+    int ch;
+
+    r = read(s->pty, buf, sizeof buf);
+    if (r == -1 && (errno == EAGAIN || errno == EINTR || errno == EIO))
+        return;
+    SYSERR(r, "read pty");
+
+    for (i = 0; i < r; ++i)
+    {
+        ch = (unsigned char) buf[i];
+
+        if (s->escstate == 1) {
+            s->escstate = ch == '[' || ch == 'O' ? 2 : 0;
+            /* Otherwise a lone ESC, ch is a key of its own. */
+            if (s->escstate)
+                continue;
+        }
+
+        if (s->escstate == 2) {
+            s->escstate = 0;
+            if (ch == 'A')
+                pushkey(s, ALIEN_KEY_UP);
+            else if (ch == 'B')
+                pushkey(s, ALIEN_KEY_DOWN);
+            else if (ch == 'C')
+                pushkey(s, ALIEN_KEY_RIGHT);
+            else if (ch == 'D')
+                pushkey(s, ALIEN_KEY_LEFT);
+            continue;
+        }
+
+        if (ch == '\033')
+            s->escstate = 1;
+        else if (ch == '\n' || ch == '\r')
+            pushkey(s, ALIEN_KEY_ENTER);
+        else if (ch >= ALIEN_ASCII_MIN && ch <= ALIEN_ASCII_MAX)
+            pushkey(s, ch);
+    }
+
+    if (s->keywanted && s->nkeys && !s->done)
+        answerkey(s);
+}
+
+static void newpty(struct session *s)
+{
+    struct termios t;
+    char *name;
+    int r;
+
+    s->pty = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    SYSERR(s->pty, "posix_openpt");
+    r = grantpt(s->pty);
+    SYSERR(r, "grantpt");
+    r = unlockpt(s->pty);
+    SYSERR(r, "unlockpt");
+
+    name = ptsname(s->pty);
+    if (!name) SYSERR(-1, "ptsname");
+
+    s->slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    SYSERR(s->slave, "open %s", name);
+
+    /* Pass escape sequences and keys through untouched. */
+    r = tcgetattr(s->slave, &t);
+    SYSERR(r, "tcgetattr");
+    cfmakeraw(&t);
+    r = tcsetattr(s->slave, TCSANOW, &t);
+    SYSERR(r, "tcsetattr");
+
+    printf("session %d: %s\n", (int) (s - sessions) + 1, name);
+}
+
+/* Start the loader for one line of the session file and wait until it
+ * stops itself, ready to be traced. */
+static void launch(struct session *s, char *line, execprog_t execprog,
+                   const uint64_t *seed)
+{
+    char *prog[MAX_SESSION_ARGS + 1];
+    char *arg, *save;
+    int status;
+    int fbfd;
+    int n = 0;
+    long r;
+
+    for (arg = strtok_r(line, " \t\n", &save); arg;
+         arg = strtok_r(NULL, " \t\n", &save))
+    {
+        if (n == MAX_SESSION_ARGS)
+            EMUERR("session %d: too many arguments", nsessions);
+        prog[n++] = arg;
+    }
+    prog[n] = NULL;
+    if (n == 0)
+        EMUERR("session %d: no program", nsessions);
+
+    scrinit(&s->screen);
+    if (seed)
+        randseed(&s->pool, *seed);
+    ansiclear(&s->term);
+    newpty(s);
+
+    /* Unused unless the program turns out to have a PT_FRAMEBUF. */
+    s->fb = newframebuf(&fbfd);
+
+    s->pid = fork();
+    SYSERR(s->pid, "fork");
+    if (s->pid == 0)
+        execprog(prog, n, fbfd);
+
+    r = waitpid(s->pid, &status, __WALL | WUNTRACED);
+    SYSERR(r, "waitpid");
+    if (!WIFSTOPPED(status))
+        EMUERR("session %d: the loader failed", nsessions);
+
+    /* Later sessions must not inherit it. */
+    r = close(fbfd);
+    SYSERR(r, "close");
+    if (!s->fb->mapped) {
+        r = munmap(s->fb, sizeof *s->fb);
+        SYSERR(r, "munmap");
+        s->fb = NULL;
+    }
+
+    r = ptrace(PTRACE_SETOPTIONS, s->pid, NULL,
+               PTRACE_O_EXITKILL | PTRACE_O_TRACESYSGOOD);
+    SYSERR(r, "PTRACE_SETOPTIONS");
+
+    s->lastpresent = nowns();
+    resume(s);
+}
+
+void supervise(const char *sessfile, execprog_t execprog,
+               const uint64_t *seed)
+{
+    FILE *f;
+    char *line = NULL;
+    size_t linecap = 0;
+    sigset_t set;
+    struct signalfd_siginfo si;
+    struct pollfd *fds;
+    struct session *s;
+    uint64_t now;
+    int64_t wait, timeout;
+    int sfd;
+    int live;
+    int i;
+    int r;
+
+    /* Child state changes arrive through sfd, next to the ptys. */
+    r = sigemptyset(&set);
+    SYSERR(r, "sigemptyset");
+    r = sigaddset(&set, SIGCHLD);
+    SYSERR(r, "sigaddset");
+    r = sigprocmask(SIG_BLOCK, &set, NULL);
+    SYSERR(r, "sigprocmask");
+    sfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    SYSERR(sfd, "signalfd");
+
+    f = fopen(sessfile, "r");
+    if (!f) SYSERR(-1, "fopen %s", sessfile);
+
+    while (getline(&line, &linecap, f) != -1)
+    {
+        sessions = realloc(sessions, (nsessions + 1) * sizeof *sessions);
+        if (!sessions) EMUERR("realloc");
+        s = &sessions[nsessions++];
+        memset(s, 0, sizeof *s);
+
+        launch(s, line, execprog, seed);
+    }
+
+    fclose(f);
+    free(line);
+    fflush(stdout);
+
+    fds = malloc((nsessions + 1) * sizeof *fds);
+    if (!fds) EMUERR("malloc");
+
+    while ((live = reap()) > 0)
+    {
+        fds[0].fd = sfd;
+        fds[0].events = POLLIN;
+
+        timeout = -1;
+        now = nowns();
+        for (i = 0; i < nsessions; ++i)
+        {
+            s = &sessions[i];
+
+            fds[i + 1].fd = s->done ? -1 : s->pty;
+            fds[i + 1].events = POLLIN;
+            if (s->term.len)
+                fds[i + 1].events |= POLLOUT;
+
+            if (!presentdue(s, now, &wait))
+                continue;
+            if (wait <= 0) {
+                present(s);
+                continue;
+            }
+            if (timeout == -1 || wait / 1000000 + 1 < timeout)
+                timeout = wait / 1000000 + 1;
+        }
+
+        r = poll(fds, nsessions + 1, timeout);
+        if (r == -1 && errno == EINTR)
+            continue;
+        SYSERR(r, "poll");
+
+        /* reap then picks up what the signals were about. */
+        while (read(sfd, &si, sizeof si) == sizeof si)
+            ;
+
+        for (i = 0; i < nsessions; ++i)
+        {
+            s = &sessions[i];
+            if (fds[i + 1].revents & POLLOUT)
+                flushout(s);
+            if (fds[i + 1].revents & POLLIN)
+                readkeys(s);
+        }
+    }
+
+    for (i = 0; i < nsessions; ++i)
+        printf("session %d: %d\n", i + 1, sessions[i].status);
+
+    exit(0);
+}
@@ -0,0 +1,16 @@
+#ifndef SUPERVISE_H
+#define SUPERVISE_H
+
+#include <stdint.h>
+
+/* Exec the loader (ptrace backend) for prog[0] with n - 1 arguments and
+ * the framebuffer memfd fbfd. */
+typedef void (*execprog_t)(char *prog[], int n, int fbfd);
+
+/* Run every line of sessfile, a program and its arguments, as its own
+ * traced session with its own pseudo-terminal, all from one event loop.
+ * seed is NULL unless getrand should be deterministic. Does not return. */
+void supervise(const char *sessfile, execprog_t execprog,
+               const uint64_t *seed);
+
+#endif // SUPERVISE_H
@@ -0,0 +1,573 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/futex.h>
+#include <linux/seccomp.h>
+#include <unistd.h>
+#include <signal.h>
+#include <ucontext.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alienabi.h"
+#include "alienos.h"
+#include "channel.h"
+#include "emuerr.h"
+#include "evlog.h"
+#include "random.h"
+#include "rewrite.h"
+#include "screen.h"
+#include "stats.h"
+#include "trap.h"
+
+#ifndef SA_RESTORER
+#define SA_RESTORER 0x04000000
+#endif
+
+#define ALTSTACK_SIZE (64 * 1024)
+#define FASTSTACK_SIZE 65536 /* Spelled out, it goes into the asm below. */
+/* How long to watch the TSC against the clock to learn its rate. */
+#define CALIBRATE_NS 2000000
+
+/* Layout expected by the rt_sigaction syscall. */
+struct ksigaction {
+    void *handler;
+    unsigned long flags;
+    void *restorer;
+    uint64_t mask;
+};
+
+/* The only two places allowed to make real syscalls once the filter is
+ * installed: rawsys (used by the handler) and the signal restorer. Both
+ * are identified by the address right after their syscall instruction,
+ * and each only gets the syscalls it is there for: the alien program can
+ * jump to them too. */
+void trapret();
+extern char rawsys_ip[], trapret_ip[];
+
+__asm__(
+    ".text\n"
+    ".globl rawsys\n"
+    "rawsys:\n"
+    "    mov %rdi, %rax\n"
+    "    mov %rsi, %rdi\n"
+    "    mov %rdx, %rsi\n"
+    "    mov %rcx, %rdx\n"
+    "    mov %r8, %r10\n"
+    "    mov %r9, %r8\n"
+    "    xor %r9d, %r9d\n"
+    "    syscall\n"
+    "rawsys_ip:\n"
+    "    ret\n"
+    "trapret:\n"
+    "    mov $15, %eax\n" /* __NR_rt_sigreturn */
+    "    syscall\n"
+    "trapret_ip:\n"
+    "    hlt\n"
+);
+
+/* Entry point of rewritten syscall sites. Expects the syscall number in
+ * rax and the return address in r11, both of which (like rcx) a real
+ * syscall clobbers anyway. Everything else the alien program can see,
+ * flags and every register state component XCR0 enables (SSE, AVX,
+ * AVX-512, ...) included, is preserved, with xsave into xsavesize bytes
+ * of the stack. On return rcx and r11 hold the return address and flags,
+ * as after a syscall. */
+long fastdispatch(long nr, long a0, long a1, long a2, long a3);
+static char faststack[FASTSTACK_SIZE] __attribute__((aligned(64), used));
+static uint64_t fastrsp __attribute__((used));
+/* Set by initfastsys: XCR0, and the xsave area size rounded up to 64. */
+static uint64_t xsavemask __attribute__((used));
+static uint64_t xsavesize __attribute__((used));
+
+__asm__(
+    ".text\n"
+    ".globl fastsys\n"
+    "fastsys:\n"
+    /* The alien stack may be anything, red zone included. */
+    "    mov %rsp, fastrsp(%rip)\n"
+    "    lea faststack+65536(%rip), %rsp\n"
+    "    push %r11\n"
+    "    pushfq\n"
+    "    cld\n"
+    "    push %rdi\n"
+    "    push %rsi\n"
+    "    push %rdx\n"
+    "    push %r8\n"
+    "    push %r9\n"
+    "    push %r10\n"
+    /* Eight pushes keep rsp 64-byte aligned for xsave, which takes its
+     * mask in edx:eax, so the arguments are reloaded through rcx. */
+    "    mov %rax, %r11\n"
+    "    mov %rsp, %rcx\n"
+    "    sub xsavesize(%rip), %rsp\n"
+    "    mov xsavemask(%rip), %eax\n"
+    "    mov xsavemask+4(%rip), %edx\n"
+    "    xsave64 (%rsp)\n"
+    "    mov %r11, %rdi\n"
+    "    mov 40(%rcx), %rsi\n"
+    "    mov 32(%rcx), %rdx\n"
+    "    mov (%rcx), %r8\n"
+    "    mov 24(%rcx), %rcx\n"
+    "    call fastdispatch\n"
+    "    mov %rax, %r11\n"
+    "    mov xsavemask(%rip), %eax\n"
+    "    mov xsavemask+4(%rip), %edx\n"
+    "    xrstor64 (%rsp)\n"
+    "    add xsavesize(%rip), %rsp\n"
+    "    mov %r11, %rax\n"
+    "    pop %r10\n"
+    "    pop %r9\n"
+    "    pop %r8\n"
+    "    pop %rdx\n"
+    "    pop %rsi\n"
+    "    pop %rdi\n"
+    "    mov (%rsp), %r11\n"
+    "    popfq\n"
+    "    pop %rcx\n"
+    "    mov fastrsp(%rip), %rsp\n"
+    "    jmp *%rcx\n"
+);
+
+static struct channel *chan;
+static struct randpool pool;
+static char altstack[ALTSTACK_SIZE];
+/* The handler times syscalls with rdtsc: clock_gettime may fall back to
+ * a real syscall, which would trap again. A tick counted from tscbase is
+ * nspertick nanoseconds after nsbase on the monotonic clock. */
+static double nspertick;
+static uint64_t tscbase, nsbase;
+
+/* emu -e: syscalls are logged here, by pid, see evlog.h. */
+static struct evring *evring;
+/* Ours, also for reading the alien program's memory, see copyin. */
+static pid_t pid;
+
+
+static void kick()
+{
+    __atomic_add_fetch(&chan->kick, 1, __ATOMIC_SEQ_CST);
+    rawsys(SYS_futex, (long) &chan->kick, FUTEX_WAKE, 1, 0, 0);
+}
+
+/* The handler cannot use stdio, so the emulator logs for us. */
+static void __attribute__((noreturn)) trapfail(const char *msg)
+{
+    strncpy(chan->err, msg, CHANNEL_ERRLEN - 1);
+    __atomic_store_n(&chan->ended, 1, __ATOMIC_SEQ_CST);
+    kick();
+
+    for (;;)
+        rawsys(SYS_exit_group, EEMU, 0, 0, 0, 0);
+}
+
+/* void noreturn end(int status) */
+static void trapend(greg_t *regs)
+{
+    const char *err;
+    int status;
+
+    err = abiend(regs[REG_RDI], &status);
+    if (err)
+        trapfail(err);
+
+    __atomic_store_n(&chan->ended, 1, __ATOMIC_SEQ_CST);
+    kick();
+
+    for (;;)
+        rawsys(SYS_exit_group, status, 0, 0, 0, 0);
+}
+
+static long hostrandom(void *buf, size_t len)
+{
+    return rawsys(SYS_getrandom, (long) buf, len, 0, 0, 0);
+}
+
+/* uint32_t getrand() */
+static void trapgetrand(greg_t *regs)
+{
+    const char *err;
+    uint32_t rand;
+
+    err = abigetrand(&pool, hostrandom, &rand);
+    if (err)
+        trapfail(err);
+
+    regs[REG_RAX] = rand;
+}
+
+/* int getkey() */
+static void trapgetkey(greg_t *regs)
+{
+    uint32_t seq;
+
+    seq = __atomic_load_n(&chan->keyseq, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&chan->keywanted, 1, __ATOMIC_SEQ_CST);
+    kick();
+
+    while (__atomic_load_n(&chan->keyseq, __ATOMIC_SEQ_CST) == seq)
+        rawsys(SYS_futex, (long) &chan->keyseq, FUTEX_WAIT, seq, 0, 0);
+
+    regs[REG_RAX] = chan->key;
+}
+
+/* The alien program's memory is our own, but reading a bad pointer
+ * directly would fault in the handler (maybe holding the channel lock).
+ * process_vm_readv on ourselves fails instead. Nonzero on failure. */
+static int copyin(const struct iovec *local, const struct iovec *remote,
+                  int n)
+{
+    long want = 0, r;
+    int i;
+
+    for (i = 0; i < n; ++i)
+        want += local[i].iov_len;
+
+    r = rawsys(SYS_process_vm_readv, pid, (long) local, n, (long) remote, n);
+    return r != want;
+}
+
+/* void print(int x, int y, uint16_t *chars, int n) */
+static void trapprint(greg_t *regs)
+{
+    static struct abiprint p;
+
+    struct iovec local, remote;
+    const char *err;
+    int wasdirty;
+
+    err = abiprintargs(regs[REG_RDI], regs[REG_RSI], regs[REG_RDX],
+                       regs[REG_R10], &p, &local, &remote);
+    if (err)
+        trapfail(err);
+    if (copyin(&local, &remote, 1))
+        trapfail("print: invalid chars");
+
+    chanlock(chan);
+    wasdirty = scrdirty(&chan->screen);
+    abiprint(&chan->screen, &p);
+    chanunlock(chan);
+
+    /* The emulator sleeps while there is nothing to present. */
+    if (!wasdirty)
+        kick();
+}
+
+/* void printspans(const struct alienspan *spans, int n) */
+static void trapprintspans(greg_t *regs)
+{
+    static struct abispans p;
+    static struct iovec local[ALIEN_MAX_SPANS], remote[ALIEN_MAX_SPANS];
+
+    const char *err;
+    int wasdirty;
+
+    err = abispansargs(regs[REG_RDI], regs[REG_RSI], &p, local, remote);
+    if (err)
+        trapfail(err);
+    if (copyin(local, remote, 1))
+        trapfail("printspans: invalid spans");
+
+    err = abispanschars(&p, local, remote);
+    if (err)
+        trapfail(err);
+    if (copyin(local, remote, p.n))
+        trapfail("printspans: invalid chars");
+
+    chanlock(chan);
+    wasdirty = scrdirty(&chan->screen);
+    abispans(&chan->screen, &p);
+    chanunlock(chan);
+
+    if (!wasdirty)
+        kick();
+}
+
+/* void setcursor(int x, int y) */
+static void trapsetcursor(greg_t *regs)
+{
+    const char *err;
+    int x, y;
+    int wasdirty;
+
+    err = abicursor(regs[REG_RDI], regs[REG_RSI], &x, &y);
+    if (err)
+        trapfail(err);
+
+    chanlock(chan);
+    wasdirty = scrdirty(&chan->screen);
+    scrcursor(&chan->screen, x, y);
+    chanunlock(chan);
+
+    if (!wasdirty)
+        kick();
+}
+
+/* void present() */
+static void trappresent(greg_t *regs)
+{
+    (void) regs;
+
+    /* The emulator has the framebuffer mapped too, let it copy. */
+    __atomic_store_n(&chan->fbwanted, 1, __ATOMIC_SEQ_CST);
+    kick();
+}
+
+/* Log the syscall in regs, begun at tick start, with how long it took. */
+static void logsyscall(long nr, const greg_t *regs, uint64_t start,
+                       uint64_t ns, int64_t result)
+{
+    struct evrecord ev;
+
+    ev.ns = nsbase + (uint64_t) ((start - tscbase) * nspertick);
+    ev.durns = ns;
+    ev.pid = pid;
+    ev.nr = nr;
+    ev.args[0] = regs[REG_RDI];
+    ev.args[1] = regs[REG_RSI];
+    ev.args[2] = regs[REG_RDX];
+    ev.args[3] = regs[REG_R10];
+    ev.result = result;
+    evput(evring, &ev);
+}
+
+static void dispatch(long nr, greg_t *regs)
+{
+    uint64_t start = 0, ns;
+
+    if (chan->statson || evring) {
+        start = __builtin_ia32_rdtsc();
+
+        /* end does not return, count it on the way in. */
+        if (nr == 0 && chan->statson)
+            statsrecord(&chan->stats, nr, 0);
+        if (nr == 0 && evring)
+            logsyscall(nr, regs, start, 0, 0);
+    }
+
+    switch (nr) {
+    case 0:
+        trapend(regs);
+        break;
+    case 1:
+        trapgetrand(regs);
+        break;
+    case 2:
+        trapgetkey(regs);
+        break;
+    case 3:
+        trapprint(regs);
+        break;
+    case 4:
+        trapsetcursor(regs);
+        break;
+    case 5:
+        trapprintspans(regs);
+        break;
+    case 6:
+        trappresent(regs);
+        break;
+    default:
+        trapfail("invalid syscall number");
+        break;
+    }
+
+    if (chan->statson || evring) {
+        ns = (__builtin_ia32_rdtsc() - start) * nspertick;
+        if (chan->statson) {
+            statsrecord(&chan->stats, nr, ns);
+            chan->stats.handlerns += ns;
+        }
+        if (evring)
+            logsyscall(nr, regs, start, ns,
+                       nr == 1 || nr == 2 ? (int64_t) regs[REG_RAX] : 0);
+    }
+}
+
+static void calibrate()
+{
+    uint64_t ns, tsc, now, tscnow;
+
+    tsc = __builtin_ia32_rdtsc();
+    ns = nowns();
+    do {
+        tscnow = __builtin_ia32_rdtsc();
+        now = nowns();
+    } while (now - ns < CALIBRATE_NS);
+
+    nspertick = (double) (now - ns) / (tscnow - tsc);
+    tscbase = tscnow;
+    nsbase = now;
+}
+
+static void handletrap(int sig, siginfo_t *info, void *ctx)
+{
+    greg_t *regs = ((ucontext_t *) ctx)->uc_mcontext.gregs;
+    uint64_t ip, rax;
+
+    (void) sig;
+
+    /* rip is past the syscall instruction. */
+    ip = regs[REG_RIP] - 2;
+    rax = regs[REG_RAX];
+
+    dispatch(info->si_syscall, regs);
+    if (rewritetrap(ip, rax))
+        __atomic_add_fetch(&chan->rewritten, 1, __ATOMIC_RELAXED);
+}
+
+/* Called by fastsys for syscall sites rewritten by rewrite.c. */
+long fastdispatch(long nr, long a0, long a1, long a2, long a3)
+{
+    greg_t regs[NGREG];
+
+    regs[REG_RAX] = nr;
+    regs[REG_RDI] = a0;
+    regs[REG_RSI] = a1;
+    regs[REG_RDX] = a2;
+    regs[REG_R10] = a3;
+
+    dispatch(nr, regs);
+
+    return regs[REG_RAX];
+}
+
+int initfastsys()
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    if (xsavesize)
+        return 1;
+
+    /* OSXSAVE: xsave is there and the kernel enabled it. */
+    __asm__ volatile ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+                              : "a" (1), "c" (0));
+    if (!(ecx & 1 << 27))
+        return 0;
+
+    __asm__ volatile ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+    xsavemask = (uint64_t) edx << 32 | eax;
+
+    /* ebx: the size for what XCR0 enables. */
+    __asm__ volatile ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+                              : "a" (0xd), "c" (0));
+    if (ebx > FASTSTACK_SIZE / 2)
+        return 0;
+    xsavesize = (ebx + 63) & ~63;
+
+    return 1;
+}
+
+void inittrap(int chanfd, int evfd)
+{
+    struct ksigaction sa;
+    stack_t ss;
+    long r;
+
+    chan = mmap(NULL, sizeof *chan, PROT_READ | PROT_WRITE, MAP_SHARED,
+                chanfd, 0);
+    SYS2ERR(chan, "mmap channel");
+
+    r = close(chanfd);
+    SYSERR(r, "close channel");
+
+    if (evfd != -1) {
+        evring = mmap(NULL, sizeof *evring, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, evfd, 0);
+        SYS2ERR(evring, "mmap evlog");
+
+        r = close(evfd);
+        SYSERR(r, "close evlog");
+    }
+    pid = getpid();
+
+    if (chan->seeded)
+        randseed(&pool, chan->seed);
+    if (chan->statson || evring)
+        calibrate();
+
+    /* Nobody traces us, so there is no PTRACE_O_EXITKILL to rely on. */
+    r = prctl(PR_SET_PDEATHSIG, SIGKILL);
+    SYSERR(r, "PR_SET_PDEATHSIG");
+
+    /* The alien program may do anything with its stack pointer. */
+    ss.ss_sp = altstack;
+    ss.ss_size = sizeof altstack;
+    ss.ss_flags = 0;
+    r = sigaltstack(&ss, NULL);
+    SYSERR(r, "sigaltstack");
+
+    /* Bypass libc to get our own restorer, see rawsys. */
+    memset(&sa, 0, sizeof sa);
+    sa.handler = handletrap;
+    sa.flags = SA_SIGINFO | SA_ONSTACK | SA_RESTORER;
+    sa.restorer = trapret;
+    r = syscall(SYS_rt_sigaction, SIGSYS, &sa, NULL, sizeof sa.mask);
+    SYSERR(r, "rt_sigaction");
+}
+
+void starttrap()
+{
+    uint64_t rawip, retip;
+    long r;
+
+    rawip = (uint64_t) rawsys_ip;
+    retip = (uint64_t) trapret_ip;
+    if (rawip >> 32 != retip >> 32)
+        EMUERR("starttrap: syscall sites too far apart");
+
+    /* Anything else traps, to be served or failed as an AlienOS syscall
+     * (or, from within the handler, to kill the process). */
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 offsetof(struct seccomp_data, arch)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 offsetof(struct seccomp_data, instruction_pointer) + 4),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, rawip >> 32, 0, 13),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 offsetof(struct seccomp_data, instruction_pointer)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t) rawip, 1, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t) retip, 8, 10),
+
+        /* rawsys: what the handler and rewritetrap use, process_vm_readv
+         * (see copyin) only on ourselves. */
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_futex, 9, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_exit_group, 8, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_getrandom, 7, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_mprotect, 6, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_process_vm_readv, 0, 4),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 offsetof(struct seccomp_data, args[0])),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t) pid, 3, 2),
+
+        /* trapret: only rt_sigreturn. */
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_rt_sigreturn, 1, 0),
+
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRAP),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    struct sock_fprog prog = {
+        .len = sizeof filter / sizeof filter[0],
+        .filter = filter,
+    };
+
+    r = prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
+    SYSERR(r, "PR_SET_NO_NEW_PRIVS");
+
+    r = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, 0, &prog);
+    SYSERR(r, "seccomp");
+}
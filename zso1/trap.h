@@ -0,0 +1,25 @@
+#ifndef TRAP_H
+#define TRAP_H
+
+/* Map the channel shared with the emulator, and the event log ring if
+ * evfd is not -1, and install the SIGSYS handler serving AlienOS
+ * syscalls in-process. */
+void inittrap(int chanfd, int evfd);
+
+/* Install the seccomp filter. From now on every syscall not made by the
+ * handler itself traps, so this must be the last thing before jumping
+ * to the alien program. */
+void starttrap();
+
+/* In-process entry point for rewritten syscall sites, see rewrite.c. */
+void fastsys();
+
+/* Nonzero once fastsys can preserve the full register state with xsave,
+ * 0 if this CPU cannot. */
+int initfastsys();
+
+/* A real syscall, the only way allowed once starttrap has run, and only
+ * for what the handler needs (see starttrap). A sixth argument is 0. */
+long rawsys(long nr, long a1, long a2, long a3, long a4, long a5);
+
+#endif // TRAP_H
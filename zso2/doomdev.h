@@ -136,6 +136,9 @@ struct doomdev_span {
 #define DOOMDEV_SURF_IOCTL_DRAW_BACKGROUND _IOW('D', 0x13, struct doomdev_surf_ioctl_draw_background)
 #define DOOMDEV_SURF_IOCTL_DRAW_COLUMNS _IOW('D', 0x14, struct doomdev_surf_ioctl_draw_columns)
 #define DOOMDEV_SURF_IOCTL_DRAW_SPANS _IOW('D', 0x15, struct doomdev_surf_ioctl_draw_spans)
+/* Wait until every draw into the surface so far has finished, e.g. before
+ * reading it through mmap (read-only, width * height bytes).  */
+#define DOOMDEV_SURF_IOCTL_WAIT _IO('D', 0x16)
 
 #define DOOMDEV_DRAW_FLAGS_FUZZ		0x01
 #define DOOMDEV_DRAW_FLAGS_TRANSLATE	0x02
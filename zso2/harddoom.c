@@ -10,6 +10,13 @@
 #include <linux/anon_inodes.h>
 #include <linux/mutex.h>
 #include <linux/completion.h>
+#include <linux/dma-mapping.h>
+#include <linux/moduleparam.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
 #include <asm/uaccess.h>
 #include <asm/spinlock.h>
 
@@ -22,6 +29,11 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Tom Macieszczak");
 MODULE_DESCRIPTION("HardDoom driver");
 
+static bool cmd_ring = true;
+module_param(cmd_ring, bool, 0444);
+MODULE_PARM_DESC(cmd_ring,
+                 "Fetch commands from a DMA ring (default) or use FIFO_SEND");
+
 
 /* -- MACROS -- */
 
@@ -29,6 +41,20 @@ MODULE_DESCRIPTION("HardDoom driver");
 #define MAP_SIZE 0x100
 #define SPAN_MASK 0x3FFFFF
 
+/* Command ring read by FETCH_CMD. The last word is a JUMP back to the
+ * start, the others hold commands. */
+#define RING_BYTES 0x10000
+#define RING_WORDS (RING_BYTES / 4)
+#define RING_LAST (RING_WORDS - 1)
+
+/* How often hd_cmd puts a PING_ASYNC in between, so that a full ring or
+ * FIFO always has one coming to wait for. */
+#define RING_PING_PERIOD (RING_LAST / 8)
+#define FIFO_PING_PERIOD (512 / 4)
+
+/* Interrupts always on, PONG_ASYNC only while waiting for free space. */
+#define INTR_ENABLED (HARDDOOM_INTR_PONG_SYNC | HARDDOOM_INTR_FENCE)
+
 
 #define HD_PRINT(Level, Format, ...) \
     printk(Level "HardDoom:%s:%d:" Format "\n", __func__, __LINE__, ##__VA_ARGS__)
@@ -64,24 +90,31 @@ do {                               \
         (const void __user *) userbuf + index * sizeof(object), \
         sizeof(object))
 
-/** Template for the body of *_release functions */
-#define SYNCED_RELEASE(type, resource, release)  \
-{                                                \
-    struct hd_dev *dev;                          \
-    dev = ((type *) (resource))->dev;            \
-    if (mutex_lock_interruptible(&dev->mutex))   \
-         return_err(-ERESTARTSYS);               \
-    hd_sync(dev);                                \
-    release(resource);                           \
-    mutex_unlock(&dev->mutex);                   \
-    kref_put(&dev->refcount, hd_release);        \
-    return 0;                                    \
+/** Template for the body of *_release functions. The mutex only makes
+ *  the fence final; the object is freed by hd_reap once it has passed,
+ *  which also drops its reference to the device. The return value of
+ *  release is ignored, so the mutex is taken uninterruptibly: giving up
+ *  on a signal would leak the object. */
+#define DEFERRED_RELEASE(type, resource, release) \
+{                                                 \
+    type *res;                                    \
+    struct hd_dev *dev;                           \
+    res = resource;                               \
+    dev = res->dev;                               \
+    mutex_lock(&dev->mutex);                      \
+    res->zombie.fence = res->fence;               \
+    mutex_unlock(&dev->mutex);                    \
+    res->zombie.free = release;                   \
+    hd_bury(dev, &res->zombie);                   \
+    return 0;                                     \
 }
 
 /* -- TYPES -- */
 
 struct hd_dev {
     void __iomem *bar0;
+    /* What paged buffers are mapped for with dma_map_page. */
+    struct device *dma_dev;
     struct dma_pool *page_pool;
     struct dma_pool *map_pool;
     struct cdev cdev;
@@ -94,6 +127,27 @@ struct hd_dev {
     struct kref refcount;
     u16 free_cmds;
     u16 ping_async;
+    /* NULL when commands go through FIFO_SEND. */
+    u32 *ring;
+    dma_addr_t ring_dma;
+    u32 ring_tail;
+    /* The last FENCE sent, FENCE_LAST holds its low bits once done. */
+    u64 fence;
+    /* What FENCE_WAIT is set to, under fence_lock. */
+    u64 fence_wait;
+    spinlock_t fence_lock;
+    wait_queue_head_t fence_wq;
+    /* Released objects the device may still use, under zombie_lock. */
+    struct list_head zombies;
+    spinlock_t zombie_lock;
+    struct work_struct reap_work;
+};
+
+/** A released object waiting for its fence before free is called. */
+struct zombie {
+    struct list_head list;
+    u64 fence;
+    void (*free)(struct zombie *zombie);
 };
 
 struct dma_block {
@@ -101,9 +155,17 @@ struct dma_block {
     dma_addr_t dma;
 };
 
+/* A page of a paged_buf: a page of its own from alloc_page, so that
+ * surface_mmap can hand it to vm_insert_page, mapped for the device. */
+struct dma_page {
+    struct page *page;
+    void *virt;
+    dma_addr_t dma;
+};
+
 struct paged_buf {
     size_t page_num;
-    struct dma_block *addr;
+    struct dma_page *addr;
     dma_addr_t page_table;
 };
 
@@ -113,6 +175,8 @@ struct surface {
     u16 height;
     struct paged_buf pbuf;
     u64 interlock;
+    u64 fence;
+    struct zombie zombie;
 };
 
 struct texture {
@@ -120,18 +184,24 @@ struct texture {
     u32 size;
     u16 height;
     struct paged_buf pbuf;
+    u64 fence;
+    struct zombie zombie;
 };
 
 struct flat {
     struct hd_dev *dev;
     void *virt;
     dma_addr_t dma;
+    u64 fence;
+    struct zombie zombie;
 };
 
 struct colormaps {
     struct hd_dev *dev;
     struct dma_block *addr;
     u32 num;
+    u64 fence;
+    struct zombie zombie;
 };
 
 
@@ -285,9 +355,19 @@ static void hd_turn_on(struct hd_dev *dev)
     hd_load_microcode(dev);
     hd_iowrite(dev, HARDDOOM_RESET, HARDDOOM_RESET_ALL);
     hd_iowrite(dev, HARDDOOM_INTR,  HARDDOOM_INTR_MASK);
-    hd_iowrite(dev, HARDDOOM_INTR_ENABLE, HARDDOOM_INTR_PONG_SYNC);
-    hd_iowrite(dev, HARDDOOM_ENABLE,
-                    HARDDOOM_ENABLE_ALL ^ HARDDOOM_ENABLE_FETCH_CMD);
+    hd_iowrite(dev, HARDDOOM_INTR_ENABLE, INTR_ENABLED);
+    hd_iowrite(dev, HARDDOOM_FENCE_LAST, dev->fence & HARDDOOM_FENCE_MASK);
+
+    dev->free_cmds = 0;
+
+    if (dev->ring) {
+        dev->ring_tail = 0;
+        hd_iowrite(dev, HARDDOOM_CMD_READ_PTR, dev->ring_dma);
+        hd_iowrite(dev, HARDDOOM_CMD_WRITE_PTR, dev->ring_dma);
+        hd_iowrite(dev, HARDDOOM_ENABLE, HARDDOOM_ENABLE_ALL);
+    } else
+        hd_iowrite(dev, HARDDOOM_ENABLE,
+                        HARDDOOM_ENABLE_ALL ^ HARDDOOM_ENABLE_FETCH_CMD);
 }
 
 static void hd_turn_off(struct hd_dev *dev)
@@ -297,34 +377,71 @@ static void hd_turn_off(struct hd_dev *dev)
     hd_ioread(dev, HARDDOOM_ENABLE);
 }
 
+/** Publish everything put in the ring so far with one MMIO write.
+ *  Called once per ioctl and before waiting for the device. */
+static void hd_flush(struct hd_dev *dev)
+{
+    if (!dev->ring)
+        return;
+
+    wmb(); // ring words before the write pointer
+    hd_iowrite(dev, HARDDOOM_CMD_WRITE_PTR,
+               dev->ring_dma + dev->ring_tail * 4);
+}
+
+/** Free command slots: in the FIFO or, with the ring, between our tail
+ *  and the word FETCH_CMD reads next (one slot always stays empty). */
+static u16 hd_free_cmds(struct hd_dev *dev)
+{
+    u32 read;
+
+    if (!dev->ring)
+        return hd_ioread(dev, HARDDOOM_FIFO_FREE);
+
+    read = (hd_ioread(dev, HARDDOOM_CMD_READ_PTR) - dev->ring_dma) / 4;
+    if (read == RING_LAST) // at the JUMP
+        read = 0;
+
+    return min_t(u32, (read + RING_LAST - dev->ring_tail - 1) % RING_LAST,
+                 U16_MAX);
+}
+
 static void _hd_cmd(struct hd_dev *dev, u32 cmd)
 {
     if (!dev->free_cmds)
-        dev->free_cmds = hd_ioread(dev, HARDDOOM_FIFO_FREE);
+        dev->free_cmds = hd_free_cmds(dev);
 
     if (!dev->free_cmds)
     {
+        /* The device must see the commands it is to make room from. */
+        hd_flush(dev);
+
         hd_iowrite(dev, HARDDOOM_INTR, HARDDOOM_INTR_PONG_ASYNC);
-        dev->free_cmds = hd_ioread(dev, HARDDOOM_FIFO_FREE);
+        dev->free_cmds = hd_free_cmds(dev);
 
         if (!dev->free_cmds) {
             reinit_completion(&dev->async_compl);
             hd_iowrite(dev, HARDDOOM_INTR_ENABLE,
-                       HARDDOOM_INTR_PONG_SYNC | HARDDOOM_INTR_PONG_ASYNC);
+                       INTR_ENABLED | HARDDOOM_INTR_PONG_ASYNC);
             wait_for_completion(&dev->async_compl);
 
-            dev->free_cmds = hd_ioread(dev, HARDDOOM_FIFO_FREE);
+            dev->free_cmds = hd_free_cmds(dev);
         }
     }
 
     --dev->free_cmds;
 
-    hd_iowrite(dev, HARDDOOM_FIFO_SEND, cmd);
+    if (dev->ring) {
+        dev->ring[dev->ring_tail] = cmd;
+        dev->ring_tail = (dev->ring_tail + 1) % RING_LAST;
+    } else
+        hd_iowrite(dev, HARDDOOM_FIFO_SEND, cmd);
 }
 
 static void hd_cmd(struct hd_dev *dev, u32 cmd)
 {
-    dev->ping_async = (dev->ping_async + 1) % (512 / 4);
+    dev->ping_async = (dev->ping_async + 1) %
+                      (dev->ring ? RING_PING_PERIOD : FIFO_PING_PERIOD);
 
     if (!dev->ping_async)
         _hd_cmd(dev, HARDDOOM_CMD_PING_ASYNC);
@@ -336,9 +453,57 @@ static void hd_sync(struct hd_dev *dev)
 {
     reinit_completion(&dev->sync_compl);
     hd_cmd(dev, HARDDOOM_CMD_PING_SYNC);
+    hd_flush(dev);
     wait_for_completion(&dev->sync_compl);
 }
 
+/** Tag everything sent so far with a new fence and return it. */
+static u64 hd_fence(struct hd_dev *dev)
+{
+    u64 fence;
+
+    fence = dev->fence + 1;
+    WRITE_ONCE(dev->fence, fence);
+    hd_cmd(dev, HARDDOOM_CMD_FENCE(fence & HARDDOOM_FENCE_MASK));
+
+    return fence;
+}
+
+/** The last fence passed. FENCE_LAST is read first, so it can only be
+ *  behind dev->fence, by less than the ring or FIFO holds. */
+static u64 hd_fence_last(struct hd_dev *dev)
+{
+    u32 last;
+    u64 sent;
+
+    last = hd_ioread(dev, HARDDOOM_FENCE_LAST);
+    rmb();
+    sent = READ_ONCE(dev->fence);
+
+    return sent - ((sent - last) & HARDDOOM_FENCE_MASK);
+}
+
+/** Whether fence has passed. If not, make sure FENCE_WAIT interrupts us
+ *  no later than at it; a waiter woken for an earlier fence re-arms. */
+static int hd_fence_check(struct hd_dev *dev, u64 fence)
+{
+    u64 last;
+
+    last = hd_fence_last(dev);
+    if (last >= fence)
+        return 1;
+
+    spin_lock(&dev->fence_lock);
+    if (dev->fence_wait <= last || fence < dev->fence_wait) {
+        dev->fence_wait = fence;
+        hd_iowrite(dev, HARDDOOM_FENCE_WAIT, fence & HARDDOOM_FENCE_MASK);
+    }
+    spin_unlock(&dev->fence_lock);
+
+    // it may have passed before FENCE_WAIT was set
+    return hd_fence_last(dev) >= fence;
+}
+
 static irqreturn_t hd_irq_handler(int irq, void *dev)
 {
     u32 intr;
@@ -349,14 +514,20 @@ static irqreturn_t hd_irq_handler(int irq, void *dev)
     hd_iowrite(dev, HARDDOOM_INTR,  intr);
 
     if (intr & HARDDOOM_INTR_PONG_ASYNC) {
-        hd_iowrite(dev, HARDDOOM_INTR_ENABLE, HARDDOOM_INTR_PONG_SYNC);
+        hd_iowrite(dev, HARDDOOM_INTR_ENABLE, INTR_ENABLED);
         complete(&((struct hd_dev *) dev)->async_compl);
     }
 
     if (intr & HARDDOOM_INTR_PONG_SYNC)
         complete(&((struct hd_dev *) dev)->sync_compl);
 
-    if (intr & ~(HARDDOOM_INTR_PONG_ASYNC | HARDDOOM_INTR_PONG_SYNC))
+    if (intr & HARDDOOM_INTR_FENCE) {
+        wake_up_all(&((struct hd_dev *) dev)->fence_wq);
+        schedule_work(&((struct hd_dev *) dev)->reap_work);
+    }
+
+    if (intr & ~(HARDDOOM_INTR_PONG_ASYNC | HARDDOOM_INTR_PONG_SYNC |
+                 HARDDOOM_INTR_FENCE))
         HD_PRINT(KERN_ERR, "unexpected interrupt mask: %x %x %x",
             intr,
             hd_ioread(dev, HARDDOOM_FE_ERROR_CODE),
@@ -373,6 +544,49 @@ static void hd_release(struct kref *kref)
     complete(&dev->remove_compl);
 }
 
+/** Free the zombies whose fence has passed, and have FENCE_WAIT bring us
+ *  back for the earliest of the rest. */
+static void hd_reap(struct work_struct *work)
+{
+    struct hd_dev *dev;
+    struct zombie *z, *next;
+    LIST_HEAD(dead);
+    u64 last;
+    u64 wait = 0;
+
+    dev = container_of(work, struct hd_dev, reap_work);
+    last = hd_fence_last(dev);
+
+    spin_lock(&dev->zombie_lock);
+    list_for_each_entry_safe(z, next, &dev->zombies, list) {
+        if (z->fence <= last)
+            list_move_tail(&z->list, &dead);
+        else if (!wait || z->fence < wait)
+            wait = z->fence;
+    }
+    spin_unlock(&dev->zombie_lock);
+
+    // passed while FENCE_WAIT was being set, no interrupt then
+    if (wait && hd_fence_check(dev, wait))
+        schedule_work(&dev->reap_work);
+
+    /* Each holds a device reference, the last one may let hd_remove go
+     * on, which waits for this work before freeing dev. */
+    list_for_each_entry_safe(z, next, &dead, list) {
+        z->free(z);
+        kref_put(&dev->refcount, hd_release);
+    }
+}
+
+static void hd_bury(struct hd_dev *dev, struct zombie *zombie)
+{
+    spin_lock(&dev->zombie_lock);
+    list_add_tail(&zombie->list, &dev->zombies);
+    spin_unlock(&dev->zombie_lock);
+
+    schedule_work(&dev->reap_work);
+}
+
 
 static void free_dma_blocks(struct dma_pool *pool,
                             struct dma_block *blocks, size_t n)
@@ -403,6 +617,69 @@ err_kmalloc:
     return NULL;
 }
 
+static void free_dma_pages(struct hd_dev *dev,
+                           struct dma_page *pages, size_t n)
+{
+    while (n--) {
+        dma_unmap_page(dev->dma_dev, pages[n].dma, PAGE_SIZE,
+                       DMA_BIDIRECTIONAL);
+        __free_page(pages[n].page);
+    }
+    kfree(pages);
+}
+
+/** Zeroed pages below 4 GiB (the device's DMA mask), so that mapping
+ *  them never needs a bounce buffer. */
+static struct dma_page *zalloc_dma_pages(struct hd_dev *dev, size_t n)
+{
+    int i;
+    struct dma_page *pages;
+
+    pages = kmalloc_array(n, sizeof(*pages), GFP_KERNEL);
+    if (!pages) errjmp(err_kmalloc);
+
+    for (i = 0; i < n; ++i) {
+        pages[i].page = alloc_page(GFP_KERNEL | GFP_DMA32 | __GFP_ZERO);
+        if (!pages[i].page) errjmp(err_page);
+
+        pages[i].virt = page_address(pages[i].page);
+        pages[i].dma = dma_map_page(dev->dma_dev, pages[i].page, 0,
+                                    PAGE_SIZE, DMA_BIDIRECTIONAL);
+        if (dma_mapping_error(dev->dma_dev, pages[i].dma)) {
+            __free_page(pages[i].page);
+            errjmp(err_page);
+        }
+    }
+
+    return pages;
+
+err_page:
+    free_dma_pages(dev, pages, i);
+err_kmalloc:
+    return NULL;
+}
+
+/** The device sees what the CPU wrote to the pages [from, to). */
+static void sync_paged_buffer_for_device(struct hd_dev *dev,
+                                         struct paged_buf *pbuf,
+                                         size_t from, size_t to)
+{
+    for (; from < to; ++from)
+        dma_sync_single_for_device(dev->dma_dev, pbuf->addr[from].dma,
+                                   PAGE_SIZE, DMA_BIDIRECTIONAL);
+}
+
+/** The CPU sees what the device wrote to the pages. */
+static void sync_paged_buffer_for_cpu(struct hd_dev *dev,
+                                      struct paged_buf *pbuf)
+{
+    size_t i;
+
+    for (i = 0; i < pbuf->page_num; ++i)
+        dma_sync_single_for_cpu(dev->dma_dev, pbuf->addr[i].dma,
+                                PAGE_SIZE, DMA_BIDIRECTIONAL);
+}
+
 static int alloc_paged_buffer(struct hd_dev *dev,
                               struct paged_buf *pbuf, size_t len)
 {
@@ -426,13 +703,14 @@ static int alloc_paged_buffer(struct hd_dev *dev,
     }
     pbuf->page_num = page_num;
 
-    pbuf->addr = zalloc_dma_blocks(dev->page_pool, page_num);
+    pbuf->addr = zalloc_dma_pages(dev, page_num);
     if (!pbuf->addr) return_err(-ENOMEM);
 
     page_table = pbuf->addr[page_num - 1].virt + pt_offset;
 
     for (i = 0; i < page_num; ++i)
         page_table[i] =  pbuf->addr[i].dma | HARDDOOM_PTE_VALID;
+    sync_paged_buffer_for_device(dev, pbuf, page_num - 1, page_num);
 
     pbuf->page_table = pbuf->addr[page_num - 1].dma + pt_offset;
 
@@ -441,7 +719,7 @@ static int alloc_paged_buffer(struct hd_dev *dev,
 
 static void free_paged_buffer(struct hd_dev *dev, struct paged_buf *pbuf)
 {
-    free_dma_blocks(dev->page_pool, pbuf->addr, pbuf->page_num);
+    free_dma_pages(dev, pbuf->addr, pbuf->page_num);
 }
 
 static int bad_point(struct surface *surf, u16 x, u16 y)
@@ -503,6 +781,8 @@ long surf_fill_rects(struct surface *surf,
         count++;
     }
     surf->interlock = dev->interlock;
+    surf->fence = hd_fence(dev);
+    hd_flush(dev);
     mutex_unlock(&dev->mutex);
 
     if (!count && err) return_err(err);
@@ -566,8 +846,10 @@ long surf_copy_rects(struct surface *surf,
         count++;
     }
     surf->interlock = dev->interlock;
+    surf->fence = src_surf->fence = hd_fence(dev);
 
 err_invalid:
+    hd_flush(dev);
     mutex_unlock(&dev->mutex);
 
     if (!count && err) return_err(err);
@@ -611,6 +893,8 @@ long surf_draw_lines(struct surface *surf,
         count++;
     }
     surf->interlock = dev->interlock;
+    surf->fence = hd_fence(dev);
+    hd_flush(dev);
     mutex_unlock(&dev->mutex);
 
     if (!count && err) return_err(err);
@@ -639,8 +923,10 @@ long surf_draw_background(struct surface *surf,
     hd_cmd(dev, HARDDOOM_CMD_DRAW_BACKGROUND);
 
     surf->interlock = dev->interlock;
+    surf->fence = flat->fence = hd_fence(dev);
 
 err_invalid:
+    hd_flush(dev);
     mutex_unlock(&dev->mutex);
 
     return err;
@@ -741,8 +1027,13 @@ long surf_draw_columns(struct surface *surf,
         count++;
     }
     surf->interlock = dev->interlock;
+    surf->fence = hd_fence(dev);
+    if (text) text->fence = surf->fence;
+    if (tran) tran->fence = surf->fence;
+    if (cmap) cmap->fence = surf->fence;
 
 err_invalid:
+    hd_flush(dev);
     mutex_unlock(&dev->mutex);
 
     if (!count && err) return_err(err);
@@ -832,14 +1123,34 @@ long surf_draw_spans(struct surface *surf,
         count++;
     }
     surf->interlock = dev->interlock;
+    surf->fence = flat->fence = hd_fence(dev);
+    if (tran) tran->fence = surf->fence;
+    if (cmap) cmap->fence = surf->fence;
 
 err_invalid:
+    hd_flush(dev);
     mutex_unlock(&dev->mutex);
 
     if (!count && err) return_err(err);
     return count;
 }
 
+long surf_wait(struct surface *surf)
+{
+    u64 fence;
+
+    /* Draws into surf that are still running, not anyone else's. */
+    fence = READ_ONCE(surf->fence);
+    if (wait_event_interruptible(surf->dev->fence_wq,
+                                 hd_fence_check(surf->dev, fence)))
+        return_err(-ERESTARTSYS);
+
+    // for surface_read and whoever has the surface mapped
+    sync_paged_buffer_for_cpu(surf->dev, &surf->pbuf);
+
+    return 0;
+}
+
 long surface_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
     struct surface *surf;
@@ -873,6 +1184,8 @@ long surface_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
         return surf_draw_columns(surf, surf_cmd.draw_columns);
     case DOOMDEV_SURF_IOCTL_DRAW_SPANS:
         return surf_draw_spans(surf, surf_cmd.draw_spans);
+    case DOOMDEV_SURF_IOCTL_WAIT:
+        return surf_wait(surf);
     }
     return -EINVAL;
 }
@@ -888,10 +1201,8 @@ static ssize_t surface_read(struct file *file, char __user *buf,
 
     surf = file->private_data;
 
-    if (mutex_lock_interruptible(&surf->dev->mutex))
-        return_err(-ERESTARTSYS);
-
-    hd_sync(surf->dev);
+    err = surf_wait(surf);
+    if (err) return err;
 
     len = (size_t) surf->width * (size_t) surf->height;
     pos = *filepos;
@@ -923,22 +1234,82 @@ static ssize_t surface_read(struct file *file, char __user *buf,
     *filepos = pos;
 
 err_copy:
-    mutex_unlock(&surf->dev->mutex);
     return err ? err : count;
 }
 
-static void free_surface(struct surface *surf)
+static void free_surface(struct zombie *zombie)
 {
+    struct surface *surf;
+
+    surf = container_of(zombie, struct surface, zombie);
     free_paged_buffer(surf->dev, &surf->pbuf);
     kfree(surf);
 }
 
 static int surface_release(struct inode *inode, struct file *file)
-    SYNCED_RELEASE(struct surface, file->private_data, free_surface)
+    DEFERRED_RELEASE(struct surface, file->private_data, free_surface)
+
+/** Map the surface read-only, the data pages only. Each is a page of its
+ *  own from alloc_page, so vm_insert_page can take it. What the device
+ *  has written is there after DOOMDEV_SURF_IOCTL_WAIT. */
+static int surface_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    int err;
+    struct surface *surf;
+    unsigned long pages;
+    unsigned long data_pages;
+    unsigned long i;
+
+    surf = file->private_data;
+
+    if (vma->vm_flags & VM_WRITE)
+        return_err(-EACCES);
+    vma->vm_flags &= ~VM_MAYWRITE;
+    // mremap must not grow it past the surface
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+    // the page table is on the last page, see create_surface
+    data_pages = surf->pbuf.page_num - 1;
+    pages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+    if (vma->vm_pgoff >= data_pages || pages > data_pages - vma->vm_pgoff)
+        return_err(-EINVAL);
+
+    for (i = 0; i < pages; ++i) {
+        struct page *page;
+
+        page = surf->pbuf.addr[vma->vm_pgoff + i].page;
+        err = vm_insert_page(vma, vma->vm_start + i * PAGE_SIZE, page);
+        if (err) return_err(err);
+    }
+
+    return 0;
+}
+
+/** Readable once every draw into the surface so far has finished, the
+ *  same condition surf_wait sleeps on. */
+static unsigned int surface_poll(struct file *file, poll_table *wait)
+{
+    struct surface *surf;
+    u64 fence;
+
+    surf = file->private_data;
+
+    poll_wait(file, &surf->dev->fence_wq, wait);
+
+    fence = READ_ONCE(surf->fence);
+    if (hd_fence_check(surf->dev, fence)) {
+        sync_paged_buffer_for_cpu(surf->dev, &surf->pbuf);
+        return POLLIN | POLLRDNORM;
+    }
+
+    return 0;
+}
 
 static struct file_operations surface_fops = {
     .owner = THIS_MODULE,
     .read = surface_read,
+    .mmap = surface_mmap,
+    .poll = surface_poll,
     .unlocked_ioctl = surface_ioctl,
     .compat_ioctl = surface_ioctl,
     .release = surface_release,
@@ -965,10 +1336,13 @@ static long create_surface(struct hd_dev *dev,
     surf->width = cmd.width;
     surf->height = cmd.height;
     surf->interlock = 0;
+    surf->fence = 0;
 
     len = (size_t) cmd.width * (size_t) cmd.height;
 
-    err = alloc_paged_buffer(dev, &surf->pbuf, len);
+    /* Whole pages, so that the page table gets one of its own and
+     * surface_mmap never shows it. */
+    err = alloc_paged_buffer(dev, &surf->pbuf, roundup(len, PAGE_SIZE));
     if (err) errjmp(err_buffer);
 
     fd = get_unused_fd_flags(0);
@@ -995,14 +1369,17 @@ err_kmalloc:
     return err;
 }
 
-static void free_texture(struct texture *text)
+static void free_texture(struct zombie *zombie)
 {
+    struct texture *text;
+
+    text = container_of(zombie, struct texture, zombie);
     free_paged_buffer(text->dev, &text->pbuf);
     kfree(text);
 }
 
 static int texture_release(struct inode *inode, struct file *file)
-    SYNCED_RELEASE(struct texture, file->private_data, free_texture)
+    DEFERRED_RELEASE(struct texture, file->private_data, free_texture)
 
 static struct file_operations texture_fops = {
     .owner = THIS_MODULE,
@@ -1029,6 +1406,7 @@ static long create_texture(struct hd_dev *dev,
     text->dev = dev;
     text->size = roundup(cmd.size, 256);
     text->height = cmd.height;
+    text->fence = 0;
 
     err = alloc_paged_buffer(dev, &text->pbuf, text->size);
     if (err) errjmp(err_buffer);
@@ -1052,6 +1430,7 @@ static long create_texture(struct hd_dev *dev,
         pos += n;
         left -= n;
     }
+    sync_paged_buffer_for_device(dev, &text->pbuf, 0, text->pbuf.page_num);
 
     fd = anon_inode_getfd("HardDoomTexture", &texture_fops, text, 0);
     if (fd < 0) errjmp2(err = fd, err_getfd);
@@ -1068,14 +1447,17 @@ err_kmalloc:
     return err;
 }
 
-static void free_flat(struct flat *flat)
+static void free_flat(struct zombie *zombie)
 {
+    struct flat *flat;
+
+    flat = container_of(zombie, struct flat, zombie);
     dma_pool_free(flat->dev->page_pool, flat->virt, flat->dma);
     kfree(flat);
 }
 
 static int flat_release(struct inode *inode, struct file *file)
-    SYNCED_RELEASE(struct flat, file->private_data, free_flat)
+    DEFERRED_RELEASE(struct flat, file->private_data, free_flat)
 
 static struct file_operations flat_fops = {
     .owner = THIS_MODULE,
@@ -1093,6 +1475,7 @@ static long create_flat(struct hd_dev *dev,
     if (!flat) errjmp2(err = -ENOMEM, err_kmalloc);
 
     flat->dev = dev;
+    flat->fence = 0;
     flat->virt =
         dma_pool_alloc(dev->page_pool, GFP_KERNEL, &flat->dma);
     if (!flat->virt) errjmp2(err = -ENOMEM, err_pool);
@@ -1115,14 +1498,17 @@ err_kmalloc:
     return err;
 }
 
-static void free_colormaps(struct colormaps *cmaps)
+static void free_colormaps(struct zombie *zombie)
 {
+    struct colormaps *cmaps;
+
+    cmaps = container_of(zombie, struct colormaps, zombie);
     free_dma_blocks(cmaps->dev->map_pool, cmaps->addr, cmaps->num);
     kfree(cmaps);
 }
 
 static int colormaps_release(struct inode *inode, struct file *file)
-    SYNCED_RELEASE(struct colormaps, file->private_data, free_colormaps)
+    DEFERRED_RELEASE(struct colormaps, file->private_data, free_colormaps)
 
 static struct file_operations colormaps_fops = {
     .owner = THIS_MODULE,
@@ -1148,6 +1534,7 @@ static long create_colormaps(struct hd_dev *dev,
 
     cmaps->dev = dev;
     cmaps->num = cmd.num;
+    cmaps->fence = 0;
     cmaps->addr = zalloc_dma_blocks(dev->map_pool, cmd.num);
     if (!cmaps->addr) errjmp2(err = -ENOMEM, err_zalloc);
 
@@ -1250,6 +1637,7 @@ static int hd_init_pci_dev(struct pci_dev *p) {
 
     h->bar0 = pci_iomap(p, 0, HARDDOOM_PAGE_SIZE);
     if (!h->bar0) errjmp2(err = -EIO, err_iomap);
+    h->dma_dev = &p->dev;
 
     pci_set_master(p);
 
@@ -1259,6 +1647,16 @@ static int hd_init_pci_dev(struct pci_dev *p) {
     pci_set_consistent_dma_mask(p, DMA_BIT_MASK(32));
     if (err) errjmp(err_mask);
 
+    h->ring = NULL;
+    if (cmd_ring) {
+        h->ring = dma_alloc_coherent(&p->dev, RING_BYTES, &h->ring_dma,
+                                     GFP_KERNEL);
+        if (h->ring)
+            h->ring[RING_LAST] = HARDDOOM_CMD_JUMP(h->ring_dma);
+        else
+            HD_PRINT(KERN_WARNING, "no command ring, using FIFO_SEND");
+    }
+
     h->page_pool =
         dma_pool_create("HardDoom", &p->dev, PAGE_SIZE, PAGE_SIZE, 0);
     if (!h->page_pool) errjmp2(err = -ENOMEM, err_page_pool);
@@ -1267,6 +1665,14 @@ static int hd_init_pci_dev(struct pci_dev *p) {
         dma_pool_create("HardDoom", &p->dev, MAP_SIZE, MAP_SIZE, 0);
     if (!h->map_pool) errjmp2(err = -ENOMEM, err_map_pool);
 
+    h->fence = 0;
+    h->fence_wait = 0;
+    spin_lock_init(&h->fence_lock);
+    init_waitqueue_head(&h->fence_wq);
+    INIT_LIST_HEAD(&h->zombies);
+    spin_lock_init(&h->zombie_lock);
+    INIT_WORK(&h->reap_work, hd_reap);
+
     err = request_irq(p->irq, hd_irq_handler, IRQF_SHARED, "HardDoom", h);
     if (err) errjmp(err_irq);
 
@@ -1289,6 +1695,8 @@ err_irq:
 err_map_pool:
     dma_pool_destroy(h->page_pool);
 err_page_pool:
+    if (h->ring)
+        dma_free_coherent(&p->dev, RING_BYTES, h->ring, h->ring_dma);
 err_mask:
     pci_clear_master(p);
     pci_iounmap(p, h->bar0);
@@ -1309,8 +1717,11 @@ static void hd_deinit_pci_dev(struct pci_dev *p) {
 
     hd_turn_off(h);
     free_irq(p->irq, h);
+    cancel_work_sync(&h->reap_work);
     dma_pool_destroy(h->map_pool);
     dma_pool_destroy(h->page_pool);
+    if (h->ring)
+        dma_free_coherent(&p->dev, RING_BYTES, h->ring, h->ring_dma);
     pci_clear_master(p);
     pci_iounmap(p, h->bar0);
     pci_release_regions(p);
@@ -1391,6 +1802,9 @@ static int hd_resume(struct pci_dev *p)
     h = pci_get_drvdata(p);
     hd_turn_on(h);
 
+    // zombies that passed during the PING_SYNC of hd_suspend
+    schedule_work(&h->reap_work);
+
     return 0;
 }
 